@@ -6,14 +6,29 @@
 #include <strings.h>
 #include <wordexp.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <iostream>
 #include <sstream>
+#include <iomanip>
+#include <algorithm>
 #include <fstream>
-#include <regex>
 #include <string>
+#include <string_view>
 #include <filesystem>
 #include <google/protobuf/compiler/importer.h>
+#include <google/protobuf/compiler/parser.h>
 #include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/descriptor_database.h>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/tokenizer.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/wire_format_lite.h>
 #include <google/protobuf/util/json_util.h>
 #include <google/protobuf/dynamic_message.h>
 #include <google/protobuf/stubs/strutil.h>
@@ -23,10 +38,31 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <set>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace google::protobuf::compiler;
 using namespace google::protobuf::util;
 using google::protobuf::FileDescriptor;
+using google::protobuf::FileDescriptorProto;
+using google::protobuf::DescriptorProto;
+using google::protobuf::EnumDescriptorProto;
+using google::protobuf::DescriptorPool;
+using google::protobuf::SimpleDescriptorDatabase;
+using google::protobuf::DescriptorDatabase;
+using google::protobuf::FileDescriptorSet;
 using google::protobuf::Reflection;
 using google::protobuf::ServiceDescriptor;
 using google::protobuf::MethodDescriptor;
@@ -45,6 +81,7 @@ std::string getInput(CDKSCREEN* cdk_screen, const char* title, const char* label
 static void unsetFocus(CDKOBJS* obj);
 int num_rows, num_cols;
 class RequestBuilderPage;
+class UsageProfile;
 
 // Track the proto files containing the methods that we entered the request
 // builder for. If RpcExplorer was started without proto file arguments and
@@ -52,18 +89,27 @@ class RequestBuilderPage;
 // advice for faster loading.
 std::set<std::string> proto_files_of_used_methods;
 
+// Where the uses of proto files are recorded across runs, or NULL if usage is
+// not being recorded.
+UsageProfile* usage_profile = NULL;
+
 #define ROWS_FOR_ONSCREEN_HELP 8
 
-// Mostly for convenience, although this is technically bad practice.
-static DynamicMessageFactory dynamic_message_factory;
+// How long the request builder waits after the last edit before it refreshes
+// the JSON preview, in milliseconds.
+#define JSON_PREVIEW_DELAY_MS 30
 
 // True means that we offer advice about what proto files to include to make
-// RpcExplorer load faster.  Global for use in signal handler.
+// RpcExplorer load faster.
 bool offer_advice = false;
 
-// Global to help with offering advice in the signal handler.
+// The proto paths to mention when offering advice.
 std::vector<const char*> proto_paths_for_advice;
 
+// Set by the SIGINT handler. The interface returns as soon as it sees this, so
+// that main() can stop loading and offer advice before exiting.
+volatile sig_atomic_t interrupted = 0;
+
 /**
  * Command line options for this program.
  */
@@ -86,6 +132,65 @@ struct Options {
    */
   std::vector<const char*> protoFiles;
 
+  /**
+   * The number of threads used to parse proto files at startup. Defaults to
+   * the number of hardware threads.
+   */
+  int jobs;
+
+  /**
+   * The directory where parsed proto files are cached across runs. Empty
+   * means that caching is disabled.
+   */
+  std::string cache_dir;
+
+  /**
+   * The directory where the proto files that methods were used from are
+   * recorded across runs, so that they can be loaded first. Empty means that
+   * usage is not recorded.
+   */
+  std::string state_dir;
+
+  /**
+   * If lazy > 0, skip building descriptors at startup, and build the
+   * descriptors for a method's file and its dependencies when the method is
+   * first used. Every file is still parsed at startup and kept for searching,
+   * so lazy turns on lazy_comments to keep the parsed files small.
+   */
+  int lazy;
+
+  /**
+   * If lazy_comments > 0, drop the source info of proto files when loading
+   * them, and parse a file again to recover its comments when its definitions
+   * are shown.
+   */
+  int lazy_comments;
+
+  /**
+   * Glob patterns for files and directories to skip when searching the
+   * protoPaths for proto files.
+   */
+  std::vector<std::string> excludes;
+
+  /**
+   * FileDescriptorSet files, such as those written by protoc
+   * --descriptor_set_out, to load instead of parsing proto files. Imports that
+   * are missing from the sets are parsed from the protoPaths.
+   */
+  std::vector<std::string> descriptor_sets;
+
+  /**
+   * Where to write a report of where startup time went, or empty for no
+   * report. "-" means stderr, and a name ending in .json selects JSON.
+   */
+  std::string profile_startup;
+
+  /**
+   * If watch > 0, watch the protoPaths for changes to proto files and reload
+   * the changed files and the files that depend on them while running.
+   */
+  int watch;
+
   /**
    * The name of the file containing the request template that
    * RpcExplorer will inject fields into. If not provided, will be
@@ -112,10 +217,11 @@ struct ProtoCDKField {
   enum FieldCdkType field_cdk_type;
 
   /**
-   * The contents of the entry when field_cdk_obj is an ENTRY, used to cache
-   * the value across destruction and reconstruction.
+   * The contents of the entry when field_cdk_type is ENTRY. CDK objects only
+   * exist for the fields that are on screen, so this is where the value is
+   * kept, and the entry is filled from it when it is created.
    */
-  char* field_cached_value;
+  std::string field_value;
 
   /**
    * The memory for the CDK label.
@@ -123,14 +229,10 @@ struct ProtoCDKField {
   CDKLABEL* field_cdk_label;
 
   /**
-   * The row of the virtual screen that this object should be rendered on.
-   */
-  int field_virtual_row;
-
-  /**
-   * The memory for the field label string.
+   * The field label string, which is shared by the fields with the same
+   * descriptor.
    */
-  char* field_label_string;
+  const char* field_label_string;
 
   /**
    * The descriptor for the proto field that the user input should correspond to.
@@ -138,13 +240,20 @@ struct ProtoCDKField {
   const FieldDescriptor* field_descriptor;
 
   /**
-   * The ProtoCDKField that that have been added as a result of this field.
-   * When field_descriptor->is_repeated() is true, and the user hits Add, this
-   * contains the child fields.
+   * The first and last of the fields that have been added as a result of this
+   * field, as indexes into the ProtoCDKFieldTree, or -1 if there are none.
+   * When field_descriptor->is_repeated() is true, and the user hits Add, these
+   * are the child fields.
    * When field_descriptor->type() is TYPE_MESSAGE, and the user hits expand,
-   * this contains the proto fields of the child message.
+   * these are the proto fields of the child message.
    */
-  std::vector<ProtoCDKField*> children;
+  int first_child;
+  int last_child;
+
+  /**
+   * The next child of the parent of this field, or -1 for the last child.
+   */
+  int next_sibling;
 
   /**
    * Used for indentation during output.
@@ -158,34 +267,438 @@ struct ProtoCDKField {
    * 2. We skip over this ProtoCDKField when iterating the list of fields.
    */
   int hide_expand;
+
+  /**
+   * The field whose children include this field, which is
+   * ProtoCDKFieldTree::REQUEST for the top-level fields of the request, or -1
+   * for the request itself and the buttons.
+   */
+  int parent;
+
+  /**
+   * The text that this field contributes to the JSON preview, indented for
+   * its depth and without a trailing comma. Empty when the field would not be
+   * printed. Only valid when json_dirty is false.
+   */
+  std::string json_fragment;
+
+  /**
+   * True means that this field or one of its descendants changed since
+   * json_fragment was rendered.
+   */
+  bool json_dirty;
+};
+
+/**
+ * The fields of the request being built, stored contiguously and linked by
+ * their indexes, so that building a request with many fields takes linear
+ * time and memory. Indexes stay valid as fields are added, but references to
+ * fields do not.
+ */
+class ProtoCDKFieldTree {
+public:
+  /**
+   * The index of the node that stands for the request message, whose
+   * children are the top-level fields.
+   */
+  static const int REQUEST = 0;
+
+  ProtoCDKFieldTree() {
+    add(-1);
+  }
+
+  /**
+   * Add a field without CDK objects as the last child of the given parent,
+   * or without a parent if it is -1, and return its index.
+   */
+  int add(int parent) {
+    int field = nodes.size();
+    nodes.emplace_back();
+    ProtoCDKField& node = nodes.back();
+    node.field_cdk_obj = NULL;
+    node.field_cdk_label = NULL;
+    node.field_label_string = NULL;
+    node.field_descriptor = NULL;
+    node.tab_index = 0;
+    node.hide_expand = 0;
+    node.parent = parent;
+    node.first_child = -1;
+    node.last_child = -1;
+    node.next_sibling = -1;
+    node.json_dirty = true;
+    if (parent != -1) {
+      ProtoCDKField& parent_node = nodes[parent];
+      if (parent_node.last_child == -1) {
+        parent_node.first_child = field;
+      } else {
+        nodes[parent_node.last_child].next_sibling = field;
+      }
+      parent_node.last_child = field;
+    }
+    return field;
+  }
+
+  ProtoCDKField& operator[](int field) {
+    return nodes[field];
+  }
+
+  const ProtoCDKField& operator[](int field) const {
+    return nodes[field];
+  }
+
+private:
+  std::vector<ProtoCDKField> nodes;
+};
+
+/**
+ * The order in which fields are displayed, as indexes into a
+ * ProtoCDKFieldTree. Fields are always inserted right after the focused row,
+ * so the rows are kept in a gap buffer whose gap follows the focus. Inserting
+ * then costs time proportional to how far the focus moved since the last
+ * insert, rather than to the number of rows after it.
+ */
+class FieldRows {
+public:
+  FieldRows() : gap_begin(0), gap_end(0) {}
+
+  int size() const {
+    return rows.size() - (gap_end - gap_begin);
+  }
+
+  int operator[](int row) const {
+    return row < gap_begin ? rows[row] : rows[row + gap_end - gap_begin];
+  }
+
+  /**
+   * Insert a field so that it is displayed on the given row.
+   */
+  void insert(int row, int field) {
+    if (gap_begin == gap_end) {
+      grow();
+    }
+    moveGap(row);
+    rows[gap_begin++] = field;
+  }
+
+private:
+  /**
+   * Move the gap so that it starts at the given row.
+   */
+  void moveGap(int row) {
+    if (row < gap_begin) {
+      int count = gap_begin - row;
+      std::copy_backward(rows.begin() + row, rows.begin() + gap_begin,
+          rows.begin() + gap_end);
+      gap_begin -= count;
+      gap_end -= count;
+    } else if (row > gap_begin) {
+      int count = row - gap_begin;
+      std::copy(rows.begin() + gap_end, rows.begin() + gap_end + count,
+          rows.begin() + gap_begin);
+      gap_begin += count;
+      gap_end += count;
+    }
+  }
+
+  /**
+   * Double the capacity, by widening the gap.
+   */
+  void grow() {
+    int tail = rows.size() - gap_end;
+    int new_size = std::max<int>(16, rows.size() * 2);
+    rows.resize(new_size);
+    std::copy_backward(rows.begin() + gap_end, rows.begin() + gap_end + tail,
+        rows.end());
+    gap_end = new_size - tail;
+  }
+
+  std::vector<int> rows;
+  int gap_begin;
+  int gap_end;
+};
+
+/**
+ * Levels of debug messages, from the most to the least important.
+ */
+enum DebugLevel {
+  DEBUG_ERROR,
+  DEBUG_INFO,
+  DEBUG_TRACE
+};
+
+/**
+ * Categories of debug messages, which are logged independently of each other.
+ */
+enum DebugCategory {
+  DEBUG_UI = 1 << 0,
+  DEBUG_INPUT = 1 << 1,
+  DEBUG_REQUEST = 1 << 2,
+  DEBUG_SCRIPT = 1 << 3,
+  DEBUG_ALL = DEBUG_UI | DEBUG_INPUT | DEBUG_REQUEST | DEBUG_SCRIPT
 };
 
 /**
  * Used for printing debug messages to a file, for convenient separation from
- * the main curses UI.
- */
-static int debugMsg(const char *fmt, ...)
-{
-  const char* path = getenv("DEBUG_FILE");
-  if (path) {
-    FILE* file = fopen(path, "a");
-    char* buffer;
+ * the main curses UI. Messages are formatted into a lock-free ring buffer,
+ * which a background thread writes to the file, so that logging does not slow
+ * down the UI. While the buffer is full, messages are dropped and counted.
+ */
+class DebugLog {
+ public:
+  DebugLog()
+      : file(NULL)
+      , level(DEBUG_ERROR)
+      , categories(0)
+      , configured_level(DEBUG_ERROR)
+      , configured_categories(0)
+      , tail(0)
+      , head(0)
+      , dropped(0)
+      , active(false)
+      , flusher_waiting(false)
+      , stopping(false) {}
+
+  /**
+   * Start logging to the file named by DEBUG_FILE, if it is set. DEBUG_LEVEL
+   * chooses the level, one of error, info or trace, and DEBUG_CATEGORIES the
+   * comma separated categories, of ui, input, request and script. Everything
+   * is logged by default.
+   */
+  void start() {
+    const char* path = getenv("DEBUG_FILE");
+    if (path == NULL || (file = fopen(path, "a")) == NULL) {
+      return;
+    }
+    configured_level = DEBUG_TRACE;
+    const char* level_name = getenv("DEBUG_LEVEL");
+    if (level_name != NULL) {
+      if (strcasecmp(level_name, "error") == 0) {
+        configured_level = DEBUG_ERROR;
+      } else if (strcasecmp(level_name, "info") == 0) {
+        configured_level = DEBUG_INFO;
+      }
+    }
+    configured_categories = DEBUG_ALL;
+    const char* category_names = getenv("DEBUG_CATEGORIES");
+    if (category_names != NULL) {
+      configured_categories = 0;
+      std::stringstream names(category_names);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        if (name == "ui") {
+          configured_categories |= DEBUG_UI;
+        } else if (name == "input") {
+          configured_categories |= DEBUG_INPUT;
+        } else if (name == "request") {
+          configured_categories |= DEBUG_REQUEST;
+        } else if (name == "script") {
+          configured_categories |= DEBUG_SCRIPT;
+        }
+      }
+    }
+
+    slots.reset(new Slot[SLOT_COUNT]);
+    for (size_t i = 0; i < SLOT_COUNT; i++) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    flusher = std::thread([this] {
+      std::unique_lock<std::mutex> lock(wake_mutex);
+      while (!stopping) {
+        // Sleep until a message is written, then give the writers a moment
+        // to add more, so that they are written together.
+        flusher_waiting = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wake.wait(lock, [this] { return stopping || hasMessages(); });
+        flusher_waiting = false;
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        flush();
+        lock.lock();
+      }
+    });
+    level = configured_level;
+    categories = configured_categories;
+    active = true;
+  }
+
+  /**
+   * True means that messages of the category and level are logged.
+   */
+  bool enabled(DebugCategory category, DebugLevel message_level) const {
+    return (categories.load(std::memory_order_relaxed) & category) != 0 &&
+        message_level <= level.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Switch between logging everything and logging what was configured when
+   * logging started. Safe to call from a signal handler.
+   */
+  void toggleAll() {
+    if (!active) {
+      return;
+    }
+    if (level == DEBUG_TRACE && categories == DEBUG_ALL) {
+      level = configured_level;
+      categories = configured_categories;
+    } else {
+      level = DEBUG_TRACE;
+      categories = DEBUG_ALL;
+    }
+  }
+
+  /**
+   * Format a message into the buffer. Use debugMsg, which checks first
+   * whether the message is logged.
+   */
+  __attribute__((format(printf, 2, 3)))
+  void write(const char* fmt, ...) {
+    size_t position = tail.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+      slot = &slots[position % SLOT_COUNT];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+      if (difference == 0) {
+        if (tail.compare_exchange_weak(position, position + 1,
+              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else {
+        position = tail.load(std::memory_order_relaxed);
+      }
+    }
+
     va_list args;
     va_start(args, fmt);
-    int rc = vasprintf(&buffer, fmt, args);
+    int length = vsnprintf(slot->text, SLOT_SIZE, fmt, args);
     va_end(args);
-    if (rc == -1 || buffer == NULL) {
-      fputs("debugMsg: vasprintf failed to allocate buffer for format string.", file);
-      fclose(file);
-      return 1;
+    if (length >= (int)SLOT_SIZE) {
+      strcpy(slot->text + SLOT_SIZE - 5, "...\n");
+    }
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    // Wake the flusher if it is sleeping. The fence pairs with the one in the
+    // flusher, so that either it sees the message or this sees it waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (flusher_waiting.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      wake.notify_one();
+    }
+  }
+
+  /**
+   * Stop logging, writing what is left in the buffer.
+   */
+  void stop() {
+    if (!active) {
+      return;
+    }
+    active = false;
+    categories = 0;
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      stopping = true;
+      wake.notify_one();
     }
-    rc = fputs(buffer, file);
-    free(buffer);
+    if (flusher.joinable()) {
+      flusher.join();
+    }
+    flush();
     fclose(file);
-    return rc;
+    file = NULL;
   }
-  return 0;
-}
+
+ private:
+  /**
+   * True if there is a message to flush or dropped messages to report.
+   */
+  bool hasMessages() const {
+    return slots[head % SLOT_COUNT].sequence.load(std::memory_order_acquire) == head + 1 ||
+        dropped.load(std::memory_order_relaxed) > 0;
+  }
+
+  /**
+   * Write the messages in the buffer to the file. Only one thread at a time
+   * may flush.
+   */
+  void flush() {
+    while (true) {
+      Slot& slot = slots[head % SLOT_COUNT];
+      if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+        break;
+      }
+      fputs(slot.text, file);
+      slot.sequence.store(head + SLOT_COUNT, std::memory_order_release);
+      head++;
+    }
+    size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost > 0) {
+      fprintf(file, "debugMsg: dropped %zu messages while the buffer was full.\n", lost);
+    }
+    fflush(file);
+  }
+
+  static const size_t SLOT_COUNT = 4096;
+  static const size_t SLOT_SIZE = 256;
+
+  /**
+   * A message in the buffer. The sequence tells the writers and the flushing
+   * thread whose turn it is to use the slot.
+   */
+  struct Slot {
+    std::atomic<size_t> sequence;
+    char text[SLOT_SIZE];
+  };
+
+  FILE* file;
+  std::atomic<int> level;
+  std::atomic<int> categories;
+  int configured_level;
+  int configured_categories;
+  std::unique_ptr<Slot[]> slots;
+
+  /**
+   * The position of the next message to write.
+   */
+  std::atomic<size_t> tail;
+
+  /**
+   * The position of the next message to flush.
+   */
+  size_t head;
+
+  std::atomic<size_t> dropped;
+
+  /**
+   * True while logging to file, between start() and stop(). Unlike file, this
+   * can be read from a signal handler.
+   */
+  std::atomic<bool> active;
+
+  /**
+   * True while the flusher sleeps on wake until a message is written.
+   */
+  std::atomic<bool> flusher_waiting;
+
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  std::atomic<bool> stopping;
+  std::thread flusher;
+} debug_log;
+
+/**
+ * Log a debug message of a category and level. Neither the message nor its
+ * arguments are evaluated unless the category and level are being logged.
+ */
+#define debugMsg(category, level, ...) \
+  do { \
+    if (debug_log.enabled(category, level)) { \
+      debug_log.write(__VA_ARGS__); \
+    } \
+  } while (0)
 
 /**
  * Print usage to stderr and exit.
@@ -215,6 +728,35 @@ static void usage() {
        "                                       ###{FULL_RESPONSE_NAME}\n"
        "                                  2. Placeholders to directly ask the user for. These can be any alphanumeric string and can contain spaces. The name will be displayed to the user.\n"
        "                                       ###{registry name}\n"
+       "    -jN, --jobs=N               Parse proto files on N threads at startup. Defaults to the number of CPUs.\n"
+       "    --cache_dir DIR             Cache parsed proto files in DIR so that unchanged files are not parsed again\n"
+       "                                on the next run. Defaults to $XDG_CACHE_HOME/RpcExplorer or ~/.cache/RpcExplorer.\n"
+       "    --no_cache                  Do not read or write the proto cache.\n"
+       "    --state_dir DIR             Record which proto files methods are used from in DIR, and load the most used\n"
+       "                                ones first on the next run so that they can be searched for right away.\n"
+       "                                Defaults to $XDG_STATE_HOME/RpcExplorer or ~/.local/state/RpcExplorer.\n"
+       "    --no_usage_profile          Do not record or load the most used proto files first.\n"
+       "    --exclude GLOB              Skip files and directories matching GLOB when searching the proto paths for\n"
+       "                                proto files. A GLOB without a slash matches names at any depth, and one with a\n"
+       "                                slash matches paths relative to the proto path. May be specified multiple\n"
+       "                                times. Patterns are also read from .rpcexplorerignore files, one per line,\n"
+       "                                relative to the directory containing the file.\n"
+       "    --lazy                      Skip building descriptors at startup, and build those of a method's file and\n"
+       "                                its imports when the method is first used. Proto errors are then reported\n"
+       "                                late. Every proto file is still parsed at startup and kept in memory for\n"
+       "                                searching. Implies --lazy_comments.\n"
+       "    --lazy_comments             Do not keep comments and source locations in memory. Definitions shown with F1\n"
+       "                                read their comments from the proto file again, which for files from descriptor\n"
+       "                                sets only works if the file is also in the proto paths.\n"
+       "    --descriptor_set_in FILES   Load the protos from a comma separated list of FileDescriptorSet files,\n"
+       "                                such as those written by protoc --descriptor_set_out, instead of searching the\n"
+       "                                proto paths. Include source info in the sets to see comments. Imports that are\n"
+       "                                missing from the sets are parsed from the proto paths.\n"
+       "    --profile_startup FILE      Write a report of where startup time went to FILE once loading finishes:\n"
+       "                                time per phase, read, parse and build time per file, dependency counts, and\n"
+       "                                the slowest and most imported files. The report is JSON if FILE ends in .json.\n"
+       "                                Use - for stderr, which makes loading finish before the interface starts.\n"
+       "    --watch                     Reload proto files that change on disk while RpcExplorer is running. Linux only.\n"
        "    proto_file                  When given, search only for methods and services in listed protos. This is an optimization.\n"
        "    --verbose                   When given, debug output will be printed to stderr.\n"
        "    --help                      Show this message.\n";
@@ -229,20 +771,45 @@ Options parseArguments(int argc, char** argv) {
   // Initialize default options
   Options options;
   options.verbose = 0;
+  options.lazy = 0;
+  options.lazy_comments = 0;
+  options.watch = 0;
+  options.jobs = std::max(1u, std::thread::hardware_concurrency());
+  if (getenv("XDG_CACHE_HOME") != NULL) {
+    options.cache_dir = std::string(getenv("XDG_CACHE_HOME")) + "/RpcExplorer";
+  } else if (getenv("HOME") != NULL) {
+    options.cache_dir = std::string(getenv("HOME")) + "/.cache/RpcExplorer";
+  }
+  if (getenv("XDG_STATE_HOME") != NULL) {
+    options.state_dir = std::string(getenv("XDG_STATE_HOME")) + "/RpcExplorer";
+  } else if (getenv("HOME") != NULL) {
+    options.state_dir = std::string(getenv("HOME")) + "/.local/state/RpcExplorer";
+  }
 
   static struct option long_options[] =
     {
       /* These options set a flag. */
       {"verbose", no_argument, &options.verbose, 1},
+      {"lazy", no_argument, &options.lazy, 1},
+      {"lazy_comments", no_argument, &options.lazy_comments, 1},
+      {"watch", no_argument, &options.watch, 1},
       {"help", no_argument, NULL, 'h'},
       {"proto_path", required_argument, 0, 'I'},
       {"request_template", required_argument, 0, 't'},
+      {"jobs", required_argument, 0, 'j'},
+      {"cache_dir", required_argument, 0, 'c'},
+      {"no_cache", no_argument, 0, 'C'},
+      {"state_dir", required_argument, 0, 's'},
+      {"no_usage_profile", no_argument, 0, 'S'},
+      {"exclude", required_argument, 0, 'x'},
+      {"descriptor_set_in", required_argument, 0, 'd'},
+      {"profile_startup", required_argument, 0, 'P'},
       {0, 0, 0, 0}
     };
   while (1) {
     int option_index = 0;
     int c;
-    c = getopt_long(argc, argv, "hI:", long_options, &option_index);
+    c = getopt_long(argc, argv, "hI:j:", long_options, &option_index);
     if (c == -1) {
       break;
     }
@@ -256,6 +823,41 @@ Options parseArguments(int argc, char** argv) {
       case 't':
         options.request_template = std::string(optarg);
         break;
+      case 'j':
+        options.jobs = atoi(optarg);
+        if (options.jobs < 1) {
+          std::cerr << "--jobs must be a positive integer." << std::endl;
+          usage();
+        }
+        break;
+      case 'c':
+        options.cache_dir = std::string(optarg);
+        break;
+      case 'C':
+        options.cache_dir.clear();
+        break;
+      case 's':
+        options.state_dir = std::string(optarg);
+        break;
+      case 'S':
+        options.state_dir.clear();
+        break;
+      case 'x':
+        options.excludes.push_back(optarg);
+        break;
+      case 'P':
+        options.profile_startup = std::string(optarg);
+        break;
+      case 'd':
+        {
+          std::istringstream descriptor_sets(optarg);
+          for (std::string path; std::getline(descriptor_sets, path, ',');) {
+            if (!path.empty()) {
+              options.descriptor_sets.push_back(path);
+            }
+          }
+        }
+        break;
       case 'h':
       default:
         usage();
@@ -264,6 +866,12 @@ Options parseArguments(int argc, char** argv) {
   argc -= optind;
   argv += optind;
 
+  // Lazy mode keeps the parsed files of methods that are never used, so keep
+  // them without their comments.
+  if (options.lazy) {
+    options.lazy_comments = 1;
+  }
+
   // Make the protoPaths the current directory if empty.
   if (options.protoPaths.empty()) {
     options.protoPaths.push_back(".");
@@ -281,6 +889,21 @@ Options parseArguments(int argc, char** argv) {
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "\tverbose: %d\n", options.verbose);
     fprintf(stderr, "\trequest_template: %s\n", options.request_template.c_str());
+    fprintf(stderr, "\tjobs: %d\n", options.jobs);
+    fprintf(stderr, "\tcache_dir: %s\n", options.cache_dir.c_str());
+    fprintf(stderr, "\tstate_dir: %s\n", options.state_dir.c_str());
+    fprintf(stderr, "\tlazy: %d\n", options.lazy);
+    fprintf(stderr, "\tlazy_comments: %d\n", options.lazy_comments);
+    fprintf(stderr, "\twatch: %d\n", options.watch);
+    fprintf(stderr, "\tprofile_startup: %s\n", options.profile_startup.c_str());
+    fprintf(stderr, "\tdescriptor_sets:\n");
+    for (int i = 0; i < options.descriptor_sets.size(); i++) {
+      fprintf(stderr, "\t\t%s\n", options.descriptor_sets[i].c_str());
+    }
+    fprintf(stderr, "\texcludes:\n");
+    for (int i = 0; i < options.excludes.size(); i++) {
+      fprintf(stderr, "\t\t%s\n", options.excludes[i].c_str());
+    }
     fprintf(stderr, "\tproto_paths:\n");
     for (int i = 0; i < options.protoPaths.size(); i++) {
       fprintf(stderr, "\t\t%s\n", options.protoPaths[i]);
@@ -294,259 +917,413 @@ Options parseArguments(int argc, char** argv) {
 }
 
 /**
- * Populate message body using reflection.
+ * Parse the value that the user entered for a non-message field and set it on
+ * the message, or add it when the field is repeated. Values that cannot be
+ * parsed as enum values are skipped.
  */
-void populateMessageData(Message* message, const std::vector<ProtoCDKField*> fields) {
+void setFieldValue(Message* message, const FieldDescriptor* field_descriptor, const char* value) {
   const Reflection* reflection = message->GetReflection();
-  debugMsg("\tpopulateMessageData: Called with %d fields.\n", fields.size());
-  for (int i = 0; i < fields.size(); i++) {
-    const ProtoCDKField* proto_cdk_field = fields[i];
-    const FieldDescriptor* field_descriptor = proto_cdk_field->field_descriptor;
-    FieldDescriptor::Type field_type = field_descriptor->type();
-    debugMsg("Found field proto_field %s with is_repeated %d\n",
-        field_descriptor->full_name().c_str(),
-        field_descriptor->is_repeated());
-    // Handle repeated by iterating over children
-    if (field_descriptor->is_repeated()) {
-      for (ProtoCDKField* child : proto_cdk_field->children) {
-        if (field_type == FieldDescriptor::Type::TYPE_MESSAGE) {
-          if (child->hide_expand) {
-            // We hit expand so we should populate recursively.
-            populateMessageData(reflection->AddMessage(message,
-                  field_descriptor), child->children);
-          }
-        } else {
-          // Get the string associated with the field
-          const char* value = ((CDKENTRY*)child->field_cdk_obj)->info;
-          if (value == NULL || strlen(value) == 0) {
-            continue;
-          }
-          // Handle based on the type
-          switch(field_type) {
-            case FieldDescriptor::Type::TYPE_DOUBLE:
-              reflection->AddDouble(message, field_descriptor, atof(value));
-              break;
-
-            case FieldDescriptor::Type::TYPE_FLOAT:
-              reflection->AddFloat(message, field_descriptor, atof(value));
-              break;
-
-            case FieldDescriptor::Type::TYPE_INT64:
-            case FieldDescriptor::Type::TYPE_FIXED64:
-            case FieldDescriptor::Type::TYPE_SFIXED64:
-            case FieldDescriptor::Type::TYPE_SINT64:
-              reflection->AddInt64(message, field_descriptor, atol(value));
-              break;
-            case FieldDescriptor::Type::TYPE_INT32:
-            case FieldDescriptor::Type::TYPE_SFIXED32:
-            case FieldDescriptor::Type::TYPE_FIXED32:
-            case FieldDescriptor::Type::TYPE_SINT32:
-              reflection->AddInt32(message, field_descriptor, atoi(value));
-              break;
-
-            case FieldDescriptor::Type::TYPE_UINT64:
-              reflection->AddUInt64(message, field_descriptor, atol(value));
-              break;
-            case FieldDescriptor::Type::TYPE_UINT32:
-              reflection->AddUInt32(message, field_descriptor, atoi(value));
-              break;
-
-            case FieldDescriptor::Type::TYPE_BOOL:
-              {
-                std::string lowercase = tolower(std::string(value));
-                reflection->AddBool(message,
-                    field_descriptor,
-                    strcmp(lowercase.c_str(), "true") == 0 ||
-                    value[0] == '1');
-              }
-              break;
-
-            case FieldDescriptor::Type::TYPE_STRING:
-              reflection->AddString(message, field_descriptor, std::string(value));
-              break;
-            case FieldDescriptor::Type::TYPE_BYTES:
-              // Assume bytes are base 64 encoded
-              {
-                std::string binaryProto;
-                if (Base64Unescape(value, &binaryProto)) {
-                  reflection->AddString(message, field_descriptor, binaryProto);
-                } else {
-                  reflection->AddString(message, field_descriptor, value);
-                }
-                break;
-              }
-
-            case FieldDescriptor::Type::TYPE_ENUM:
-              {
-                const EnumDescriptor* enum_descriptor = field_descriptor->enum_type();
-                const EnumValueDescriptor* enum_value_descriptor;
-                if (isdigit(value[0])) {
-                  enum_value_descriptor = enum_descriptor->FindValueByNumber(atoi(value));
-                } else {
-                  enum_value_descriptor = enum_descriptor->FindValueByName(value);
-                }
-                if (enum_value_descriptor != nullptr) {
-                  reflection->AddEnum(message, field_descriptor, enum_value_descriptor);
-                }
-              }
-              break;
-
-            default:
-              debugMsg("Unrecognized field type %d\n", field_type);
-          }
+  bool repeated = field_descriptor->is_repeated();
+  FieldDescriptor::Type field_type = field_descriptor->type();
+  // Handle based on the type
+  switch(field_type) {
+    case FieldDescriptor::Type::TYPE_DOUBLE:
+      if (repeated) {
+        reflection->AddDouble(message, field_descriptor, atof(value));
+      } else {
+        reflection->SetDouble(message, field_descriptor, atof(value));
+      }
+      break;
 
-        }
+    case FieldDescriptor::Type::TYPE_FLOAT:
+      if (repeated) {
+        reflection->AddFloat(message, field_descriptor, atof(value));
+      } else {
+        reflection->SetFloat(message, field_descriptor, atof(value));
       }
-      continue;
-    }
-    if (field_type == FieldDescriptor::Type::TYPE_MESSAGE) {
-      if (proto_cdk_field->hide_expand) {
-        debugMsg("\tpopulateMessageData: field %s had %d children\n",
-            field_descriptor->full_name().c_str(), proto_cdk_field->children.size());
-        // We hit expand so we should populate recursively.
-        populateMessageData(reflection->MutableMessage(message,
-              field_descriptor), proto_cdk_field->children);
+      break;
+
+    case FieldDescriptor::Type::TYPE_INT64:
+    case FieldDescriptor::Type::TYPE_FIXED64:
+    case FieldDescriptor::Type::TYPE_SFIXED64:
+    case FieldDescriptor::Type::TYPE_SINT64:
+      if (repeated) {
+        reflection->AddInt64(message, field_descriptor, atol(value));
+      } else {
+        reflection->SetInt64(message, field_descriptor, atol(value));
       }
-    } else {
-      // Get the string associated with the field
-      const char* value = ((CDKENTRY*)proto_cdk_field->field_cdk_obj)->info;
-      if (value == NULL || strlen(value) == 0) {
-        continue;
+      break;
+    case FieldDescriptor::Type::TYPE_INT32:
+    case FieldDescriptor::Type::TYPE_SFIXED32:
+    case FieldDescriptor::Type::TYPE_FIXED32:
+    case FieldDescriptor::Type::TYPE_SINT32:
+      if (repeated) {
+        reflection->AddInt32(message, field_descriptor, atoi(value));
+      } else {
+        reflection->SetInt32(message, field_descriptor, atoi(value));
       }
+      break;
 
-      // Handle based on the type
-      switch(field_type) {
-        case FieldDescriptor::Type::TYPE_DOUBLE:
-          reflection->SetDouble(message, field_descriptor, atof(value));
-          break;
-
-        case FieldDescriptor::Type::TYPE_FLOAT:
-          reflection->SetFloat(message, field_descriptor, atof(value));
-          break;
+    case FieldDescriptor::Type::TYPE_UINT64:
+      if (repeated) {
+        reflection->AddUInt64(message, field_descriptor, atol(value));
+      } else {
+        reflection->SetUInt64(message, field_descriptor, atol(value));
+      }
+      break;
+    case FieldDescriptor::Type::TYPE_UINT32:
+      if (repeated) {
+        reflection->AddUInt32(message, field_descriptor, atoi(value));
+      } else {
+        reflection->SetUInt32(message, field_descriptor, atoi(value));
+      }
+      break;
 
-        case FieldDescriptor::Type::TYPE_INT64:
-        case FieldDescriptor::Type::TYPE_FIXED64:
-        case FieldDescriptor::Type::TYPE_SFIXED64:
-        case FieldDescriptor::Type::TYPE_SINT64:
-          reflection->SetInt64(message, field_descriptor, atol(value));
-          break;
-        case FieldDescriptor::Type::TYPE_INT32:
-        case FieldDescriptor::Type::TYPE_SFIXED32:
-        case FieldDescriptor::Type::TYPE_FIXED32:
-        case FieldDescriptor::Type::TYPE_SINT32:
-          reflection->SetInt32(message, field_descriptor, atoi(value));
-          break;
+    case FieldDescriptor::Type::TYPE_BOOL:
+      {
+        std::string lowercase = tolower(std::string(value));
+        bool bool_value = strcmp(lowercase.c_str(), "true") == 0 || value[0] == '1';
+        if (repeated) {
+          reflection->AddBool(message, field_descriptor, bool_value);
+        } else {
+          reflection->SetBool(message, field_descriptor, bool_value);
+        }
+      }
+      break;
 
-        case FieldDescriptor::Type::TYPE_UINT64:
-          reflection->SetUInt64(message, field_descriptor, atol(value));
-          break;
-        case FieldDescriptor::Type::TYPE_UINT32:
-          reflection->SetUInt32(message, field_descriptor, atoi(value));
-          break;
+    case FieldDescriptor::Type::TYPE_STRING:
+      if (repeated) {
+        reflection->AddString(message, field_descriptor, std::string(value));
+      } else {
+        reflection->SetString(message, field_descriptor, std::string(value));
+      }
+      break;
+    case FieldDescriptor::Type::TYPE_BYTES:
+      // Assume bytes are base 64 encoded
+      {
+        std::string binaryProto;
+        if (!Base64Unescape(value, &binaryProto)) {
+          binaryProto = value;
+        }
+        if (repeated) {
+          reflection->AddString(message, field_descriptor, binaryProto);
+        } else {
+          reflection->SetString(message, field_descriptor, binaryProto);
+        }
+        break;
+      }
 
-        case FieldDescriptor::Type::TYPE_BOOL:
-          {
-            std::string lowercase = tolower(std::string(value));
-            reflection->SetBool(message,
-                field_descriptor,
-                strcmp(lowercase.c_str(), "true") == 0 ||
-                value[0] == '1');
+    case FieldDescriptor::Type::TYPE_ENUM:
+      {
+        const EnumDescriptor* enum_descriptor = field_descriptor->enum_type();
+        const EnumValueDescriptor* enum_value_descriptor;
+        if (isdigit(value[0])) {
+          enum_value_descriptor = enum_descriptor->FindValueByNumber(atoi(value));
+        } else {
+          enum_value_descriptor = enum_descriptor->FindValueByName(value);
+        }
+        if (enum_value_descriptor != nullptr) {
+          if (repeated) {
+            reflection->AddEnum(message, field_descriptor, enum_value_descriptor);
+          } else {
+            reflection->SetEnum(message, field_descriptor, enum_value_descriptor);
           }
-          break;
+        }
+      }
+      break;
 
-        case FieldDescriptor::Type::TYPE_STRING:
-          reflection->SetString(message, field_descriptor, std::string(value));
-          break;
-        case FieldDescriptor::Type::TYPE_BYTES:
-          // Assume bytes are base 64 encoded
-          {
-            std::string binaryProto;
-            if (Base64Unescape(value, &binaryProto)) {
-              reflection->SetString(message, field_descriptor, binaryProto);
-            } else {
-              reflection->SetString(message, field_descriptor, value);
-            }
-            break;
-          }
+    default:
+      debugMsg(DEBUG_REQUEST, DEBUG_ERROR, "Unrecognized field type %d\n", field_type);
+  }
+}
 
-        case FieldDescriptor::Type::TYPE_ENUM:
-          {
-            const EnumDescriptor* enum_descriptor = field_descriptor->enum_type();
-            const EnumValueDescriptor* enum_value_descriptor;
-            if (isdigit(value[0])) {
-              enum_value_descriptor = enum_descriptor->FindValueByNumber(atoi(value));
-            } else {
-              enum_value_descriptor = enum_descriptor->FindValueByName(value);
-            }
-            if (enum_value_descriptor != nullptr) {
-              reflection->SetEnum(message, field_descriptor, enum_value_descriptor);
-            }
-          }
-          break;
+void populateMessageData(Message* message, const ProtoCDKFieldTree& fields, int parent);
 
-        default:
-          debugMsg("Unrecognized field type %d\n", field_type);
+/**
+ * Populate one field of a message body using reflection.
+ */
+void populateField(Message* message, const ProtoCDKFieldTree& fields, int field) {
+  const Reflection* reflection = message->GetReflection();
+  const ProtoCDKField& proto_cdk_field = fields[field];
+  const FieldDescriptor* field_descriptor = proto_cdk_field.field_descriptor;
+  FieldDescriptor::Type field_type = field_descriptor->type();
+  debugMsg(DEBUG_REQUEST, DEBUG_TRACE, "Found field proto_field %s with is_repeated %d\n",
+      field_descriptor->full_name().c_str(),
+      field_descriptor->is_repeated());
+  // Handle repeated by iterating over children
+  if (field_descriptor->is_repeated()) {
+    for (int child = proto_cdk_field.first_child; child != -1;
+        child = fields[child].next_sibling) {
+      if (field_type == FieldDescriptor::Type::TYPE_MESSAGE) {
+        if (fields[child].hide_expand) {
+          // We hit expand so we should populate recursively.
+          populateMessageData(reflection->AddMessage(message,
+                field_descriptor), fields, child);
+        }
+      } else {
+        // Get the string associated with the field
+        if (fields[child].field_value.empty()) {
+          continue;
+        }
+        setFieldValue(message, field_descriptor, fields[child].field_value.c_str());
       }
+    }
+    return;
+  }
+  if (field_type == FieldDescriptor::Type::TYPE_MESSAGE) {
+    if (proto_cdk_field.hide_expand) {
+      // We hit expand so we should populate recursively.
+      populateMessageData(reflection->MutableMessage(message,
+            field_descriptor), fields, field);
+    }
+  } else {
+    // Get the string associated with the field
+    if (proto_cdk_field.field_value.empty()) {
+      return;
+    }
+    setFieldValue(message, field_descriptor, proto_cdk_field.field_value.c_str());
+  }
+}
+
+/**
+ * Populate message body using reflection, from the children of the given
+ * field.
+ */
+void populateMessageData(Message* message, const ProtoCDKFieldTree& fields, int parent) {
+  debugMsg(DEBUG_REQUEST, DEBUG_TRACE, "\tpopulateMessageData: Called for %s.\n",
+      message->GetDescriptor()->full_name().c_str());
+  for (int child = fields[parent].first_child; child != -1;
+      child = fields[child].next_sibling) {
+    populateField(message, fields, child);
+  }
+}
 
+/**
+ * Split text into views of its lines, without the newlines. A last line that
+ * does not end in a newline is kept.
+ */
+void splitLines(std::string_view text, std::vector<std::string_view>* lines) {
+  lines->clear();
+  size_t begin = 0;
+  while (begin < text.size()) {
+    size_t end = text.find('\n', begin);
+    if (end == std::string_view::npos) {
+      end = text.size();
     }
+    lines->push_back(text.substr(begin, end - begin));
+    begin = end + 1;
   }
 }
 
-void showMultilineMessage(CDKSWINDOW* display, const std::string& message) {
-  static const std::unordered_set<char> special_chars {'\\', '<' };
-  cleanCDKSwindow(display);
-  std::string current_line;
-  std::vector<char*> lines;
-  for (int i = 0; i < message.size(); i++) {
-    if (message[i] == '\n') {
-      lines.push_back(strdup(current_line.c_str()));
-      current_line.clear();
-    } else {
-      // Escape special characters that are special to either cdk or curses so
-      // that they will display literally.
-      // So far, the only known characters are `<`, `\` and `/`, but there may
-      // be others lurking.
-      if (special_chars.find(message[i]) != special_chars.end()) {
-        current_line += '\\';
-      }
+/**
+ * Write a line into escaped with the characters that are special to either
+ * cdk or curses escaped, so that they will display literally.
+ */
+void escapeLine(std::string_view line, std::string* escaped) {
+  escaped->clear();
+  for (size_t i = 0; i < line.size(); i++) {
+    // So far, the only known characters are `<`, `\` and `/`, but there may
+    // be others lurking.
+    if (line[i] == '\\' || line[i] == '<') {
+      *escaped += '\\';
+    }
 
-      // Characters that follows immediately after a `<` character appear to
-      // vanish unless escaped.
-      if (i > 0 && message[i-1] == '<') {
-        current_line += '\\';
-      }
-      current_line += message[i];
+    // Characters that follows immediately after a `<` character appear to
+    // vanish unless escaped.
+    if (i > 0 && line[i-1] == '<') {
+      *escaped += '\\';
     }
+    *escaped += line[i];
+  }
+}
+
+/**
+ * Replace the removed lines of a scrolling window that start at line first
+ * with the added lines. Only the added lines are escaped and converted for
+ * cdk, where setCDKSwindowContents would convert every line again, so this
+ * works on the line lists of the window directly, keeping cdk's rules for
+ * them: they hold at least saveLines lines, and list ends in a NULL entry,
+ * which destroyCDKSwindow frees up to. The window is not drawn. Returns true
+ * if the window had to scroll up because it lost lines.
+ */
+bool spliceSwindowLines(CDKSWINDOW* display, int first, int removed,
+    const std::string_view* lines, int added) {
+  int old_size = display->listSize;
+  int new_size = old_size - removed + added;
+  for (int i = first; i < first + removed; i++) {
+    freeChtype(display->list[i]);
+  }
+  if (new_size > old_size) {
+    int capacity = std::max(new_size, display->saveLines) + 1;
+    display->list = (chtype**)realloc(display->list, capacity * sizeof(chtype*));
+    display->listPos = (int*)realloc(display->listPos, capacity * sizeof(int));
+    display->listLen = (int*)realloc(display->listLen, capacity * sizeof(int));
   }
-  if (current_line.size() > 0) {
-      lines.push_back(strdup(current_line.c_str()));
+  int tail = old_size - first - removed;
+  if (tail > 0 && added != removed) {
+    memmove(display->list + first + added, display->list + first + removed,
+        tail * sizeof(chtype*));
+    memmove(display->listPos + first + added, display->listPos + first + removed,
+        tail * sizeof(int));
+    memmove(display->listLen + first + added, display->listLen + first + removed,
+        tail * sizeof(int));
+  }
+
+  std::string escaped;
+  for (int i = 0; i < added; i++) {
+    int line = first + i;
+    escapeLine(lines[i], &escaped);
+    display->list[line] = char2Chtype(escaped.c_str(), &display->listLen[line],
+        &display->listPos[line]);
+    display->listPos[line] = justifyString(display->boxWidth,
+        display->listLen[line], display->listPos[line]);
   }
 
-  for (char* line: lines) {
-    debugMsg("showMultilineMessage: %s\n", line);
+  // Clear the lines that moved out of the tail, so that they are not freed
+  // twice.
+  for (int i = new_size; i < old_size; i++) {
+    display->list[i] = NULL;
+    display->listPos[i] = 0;
+    display->listLen[i] = 0;
   }
+  display->list[new_size] = NULL;
 
-  if (lines.size() > 0) {
-    setCDKSwindowContents(display, lines.data(), lines.size());
+  display->listSize = new_size;
+  display->widest = 0;
+  for (int i = 0; i < new_size; i++) {
+    display->widest = std::max(display->widest, display->listLen[i]);
   }
+  display->maxTopLine = std::max(0, new_size - display->viewSize);
+  display->maxLeftChar = display->widest - (display->boxWidth - 2 * BorderOf(display));
+  int old_top = display->currentTop;
+  display->currentTop = std::min(display->currentTop, display->maxTopLine);
+  return display->currentTop != old_top;
+}
 
-  // Free the memory
-  for (char* line: lines) {
-    free(line);
+/**
+ * Draw the lines of a scrolling window from first up to end that are
+ * scrolled into view, leaving the other rows of the window as they are.
+ */
+void drawSwindowLines(CDKSWINDOW* display, int first, int end) {
+  first = std::max(first, display->currentTop);
+  end = std::min(end, display->currentTop + display->viewSize);
+  for (int line = first; line < end; line++) {
+    int row = line - display->currentTop;
+    wmove(display->fieldWin, row, 0);
+    wclrtoeol(display->fieldWin);
+    if (line >= display->listSize) {
+      continue;
+    }
+    int screen_pos = display->listPos[line] - display->leftChar;
+    if (screen_pos >= 0) {
+      writeChtype(display->fieldWin, screen_pos, row, display->list[line],
+          HORIZONTAL, 0, display->listLen[line]);
+    } else {
+      writeChtype(display->fieldWin, 0, row, display->list[line], HORIZONTAL,
+          -screen_pos, display->listLen[line]);
+    }
+  }
+  if (first < end) {
+    wrefresh(display->fieldWin);
   }
 }
 
+void showMultilineMessage(CDKSWINDOW* display, const std::string& message) {
+  std::vector<std::string_view> lines;
+  splitLines(message, &lines);
+  spliceSwindowLines(display, 0, display->listSize, lines.data(), lines.size());
+}
+
 /**
- * Generate the JSON version of a message.
+ * A scrolling window whose text is replaced as a whole but changes a little
+ * at a time, like the JSON preview. Only the lines that differ from the text
+ * shown before are converted and drawn.
  */
-std::string getJsonMessage(
-    const Descriptor* input_descriptor,
-    const std::vector<ProtoCDKField*> fields) {
-  Message* message = dynamic_message_factory.GetPrototype(input_descriptor)->New();
-  // Populate message fields
-  populateMessageData(message, fields);
+class TextPane {
+ public:
+  TextPane() : display(NULL) {}
+
+  /**
+   * Show the text in a newly created, empty window.
+   */
+  void setWindow(CDKSWINDOW* new_display) {
+    display = new_display;
+    if (display != NULL) {
+      spliceSwindowLines(display, 0, display->listSize, lines.data(), lines.size());
+      drawSwindowLines(display, 0, lines.size());
+    }
+  }
+
+  /**
+   * Replace the text, drawing the lines that changed.
+   */
+  void setText(std::string new_text) {
+    splitLines(new_text, &new_lines);
+    int old_size = lines.size();
+    int new_size = new_lines.size();
+    int first = 0;
+    while (first < old_size && first < new_size && lines[first] == new_lines[first]) {
+      first++;
+    }
+    int same_tail = 0;
+    while (same_tail < old_size - first && same_tail < new_size - first &&
+        lines[old_size - 1 - same_tail] == new_lines[new_size - 1 - same_tail]) {
+      same_tail++;
+    }
+    int removed = old_size - first - same_tail;
+    int added = new_size - first - same_tail;
+    if (display != NULL && (removed > 0 || added > 0)) {
+      if (spliceSwindowLines(display, first, removed, new_lines.data() + first, added)) {
+        // Every row shows a different line once the window scrolls.
+        drawSwindowLines(display, display->currentTop,
+            display->currentTop + display->viewSize);
+      } else {
+        // Lines after a change in the number of lines move up or down.
+        drawSwindowLines(display, first,
+            removed == added ? first + added : std::max(old_size, new_size));
+      }
+    }
+
+    const char* new_data = new_text.data();
+    text.swap(new_text);
+    if (text.data() == new_data) {
+      lines.swap(new_lines);
+    } else {
+      // Short strings are kept inside the string, so the lines moved.
+      splitLines(text, &lines);
+    }
+  }
+
+  const std::string& getText() const {
+    return text;
+  }
+
+ private:
+  /**
+   * The window the text is shown in, or NULL.
+   */
+  CDKSWINDOW* display;
+
+  /**
+   * The text being shown.
+   */
+  std::string text;
 
-  // Convert to json
+  /**
+   * The lines of text.
+   */
+  std::vector<std::string_view> lines;
+
+  /**
+   * The lines of the text being set, kept to reuse their memory.
+   */
+  std::vector<std::string_view> new_lines;
+};
+
+/**
+ * Convert a message to the JSON that is shown and sent.
+ */
+std::string getJsonMessage(const Message* message) {
   std::string jsonOutput;
   JsonPrintOptions printOptions;
   printOptions.preserve_proto_field_names = true;
@@ -554,26 +1331,414 @@ std::string getJsonMessage(
   printOptions.add_whitespace = true;
   printOptions.always_print_enums_as_ints = false;
   MessageToJsonString(*message, &jsonOutput, printOptions);
-  delete message;
   return jsonOutput;
 }
 
+/**
+ * Builds the short-lived messages that requests are rendered from, on an
+ * arena that is reset for every message. The first block of the arena is
+ * kept across resets, so building a typical request does not allocate from
+ * the heap, and the whole message is freed at once.
+ */
+class RequestArena {
+public:
+  explicit RequestArena(DynamicMessageFactory* message_factory)
+      : message_factory(message_factory)
+      , initial_block(64 * 1024)
+      , arena(arenaOptions(&initial_block)) {}
+
+  /**
+   * Create an empty message of the given type. This frees the message
+   * returned by the previous call, along with everything allocated for it.
+   */
+  Message* newMessage(const Descriptor* descriptor) {
+    arena.Reset();
+    return message_factory->GetPrototype(descriptor)->New(&arena);
+  }
+
+private:
+  static google::protobuf::ArenaOptions arenaOptions(std::vector<char>* block) {
+    google::protobuf::ArenaOptions arena_options;
+    arena_options.initial_block = block->data();
+    arena_options.initial_block_size = block->size();
+    return arena_options;
+  }
+
+  DynamicMessageFactory* message_factory;
+
+  /**
+   * Memory for the first block of the arena, declared before the arena so
+   * that it outlives it.
+   */
+  std::vector<char> initial_block;
+
+  google::protobuf::Arena arena;
+};
+
+/**
+ * Copy text[begin, end) of JSON printed at one depth, re-indented as if it
+ * had been printed at a deeper depth.
+ */
+static std::string reindentJson(const std::string& text, size_t begin, size_t end,
+    int from_depth, int to_depth) {
+  std::string indent(to_depth - from_depth, ' ');
+  std::string output = indent;
+  output.reserve(end - begin + indent.size() * 8);
+  for (size_t i = begin; i < end; i++) {
+    output += text[i];
+    if (text[i] == '\n') {
+      output += indent;
+    }
+  }
+  return output;
+}
+
+/**
+ * Render the JSON text that a single field contributes to the JSON preview,
+ * by printing a message of the containing type that holds only that field.
+ * This costs as much as the field's subtree, independent of the rest of the
+ * request, and matches what printing the whole request would produce.
+ *
+ * For an element of a repeated field, the element is returned on its own,
+ * without the field name.
+ */
+static std::string renderJsonFragment(RequestArena* request_arena,
+    const ProtoCDKFieldTree& fields, int field, int depth) {
+  const ProtoCDKField& proto_cdk_field = fields[field];
+  const FieldDescriptor* field_descriptor = proto_cdk_field.field_descriptor;
+  Message* message = request_arena->newMessage(field_descriptor->containing_type());
+  bool element = field_descriptor->is_repeated() &&
+      proto_cdk_field.field_cdk_type != ADD_BUTTON;
+  if (element) {
+    setFieldValue(message, field_descriptor, proto_cdk_field.field_value.c_str());
+  } else {
+    populateField(message, fields, field);
+  }
+  std::string json = getJsonMessage(message);
+
+  // The field is printed as the only member of the message, between "{\n"
+  // and "\n}\n", or not at all. Printing stops early on values that cannot be
+  // represented in JSON, such as out of range timestamps, and then the field
+  // is left out.
+  if (json.size() < 5 || json.compare(0, 2, "{\n") != 0 ||
+      json.compare(json.size() - 3, 3, "\n}\n") != 0) {
+    return "";
+  }
+  size_t begin = 2;
+  size_t end = json.size() - 3;
+  if (!element) {
+    return reindentJson(json, begin, end, 1, depth);
+  }
+  // An element is printed between the "[\n" and "\n ]" of its array.
+  begin = json.find('\n', begin) + 1;
+  end = json.rfind('\n', end - 1);
+  return reindentJson(json, begin, end, 2, depth);
+}
+
+/**
+ * True means that the JSON for a message field does not follow the structure
+ * of its fields, such as for maps and well known types like Timestamp, so it
+ * must be rendered as a whole.
+ */
+static bool hasSpecialJsonMapping(const FieldDescriptor* field_descriptor) {
+  if (field_descriptor->type() != FieldDescriptor::Type::TYPE_MESSAGE) {
+    return false;
+  }
+  return field_descriptor->is_map() ||
+      field_descriptor->message_type()->file()->name().rfind("google/protobuf/", 0) == 0;
+}
+
+static void updateJsonFragment(RequestArena* request_arena,
+    ProtoCDKFieldTree& fields, int field);
+
+/**
+ * Join the JSON fragments of the fields of one message into a JSON object,
+ * whose closing brace is indented for the given depth. The fragments are
+ * brought up to date first.
+ *
+ * Like the JSON printer, members are ordered by field number, and only the
+ * last field set in each oneof is kept, since setting a oneof field clears
+ * the others.
+ */
+static std::string composeJsonObject(RequestArena* request_arena,
+    ProtoCDKFieldTree& fields, int parent, int depth) {
+  std::vector<const ProtoCDKField*> members;
+  std::unordered_map<const google::protobuf::OneofDescriptor*, size_t> oneof_members;
+  for (int child = fields[parent].first_child; child != -1;
+      child = fields[child].next_sibling) {
+    updateJsonFragment(request_arena, fields, child);
+    const ProtoCDKField* field = &fields[child];
+    if (field->json_fragment.empty()) {
+      continue;
+    }
+    const google::protobuf::OneofDescriptor* oneof =
+        field->field_descriptor->real_containing_oneof();
+    if (oneof != NULL) {
+      auto it = oneof_members.find(oneof);
+      if (it != oneof_members.end()) {
+        members[it->second] = field;
+        continue;
+      }
+      oneof_members[oneof] = members.size();
+    }
+    members.push_back(field);
+  }
+  if (members.empty()) {
+    return "{}";
+  }
+  std::stable_sort(members.begin(), members.end(),
+      [](const ProtoCDKField* a, const ProtoCDKField* b) {
+        return a->field_descriptor->number() < b->field_descriptor->number();
+      });
+  size_t size = depth + 3;
+  for (const ProtoCDKField* member : members) {
+    size += member->json_fragment.size() + 2;
+  }
+  std::string output;
+  output.reserve(size);
+  output += "{\n";
+  for (size_t i = 0; i < members.size(); i++) {
+    if (i > 0) {
+      output += ",\n";
+    }
+    output += members[i]->json_fragment;
+  }
+  output += '\n';
+  output.append(depth, ' ');
+  output += '}';
+  return output;
+}
+
+/**
+ * Bring the JSON fragment of a field up to date. Only dirty fields are
+ * rendered again, and an expanded message or a repeated field is assembled
+ * from the cached fragments of its children, so that the cost of an edit is
+ * proportional to the depth of the edited field rather than to the size of
+ * the request.
+ */
+static void updateJsonFragment(RequestArena* request_arena,
+    ProtoCDKFieldTree& fields, int field_index) {
+  ProtoCDKField* field = &fields[field_index];
+  if (!field->json_dirty) {
+    return;
+  }
+  field->json_dirty = false;
+  field->json_fragment.clear();
+  const FieldDescriptor* field_descriptor = field->field_descriptor;
+  int depth = field->tab_index + 1;
+  bool element = field_descriptor->is_repeated() && field->field_cdk_type != ADD_BUTTON;
+
+  if (field->field_cdk_type == ENTRY) {
+    if (!field->field_value.empty()) {
+      field->json_fragment = renderJsonFragment(request_arena, fields, field_index, depth);
+    }
+    return;
+  }
+  if (hasSpecialJsonMapping(field_descriptor)) {
+    // Elements are only rendered as part of their repeated field.
+    if (!element) {
+      field->json_fragment = renderJsonFragment(request_arena, fields, field_index, depth);
+    }
+    return;
+  }
+
+  std::string name = element ? "" : "\"" + field_descriptor->name() + "\": ";
+  if (field->field_cdk_type == ADD_BUTTON) {
+    std::vector<const std::string*> elements;
+    size_t size = name.size() + 2 * depth + 4;
+    for (int child = field->first_child; child != -1;
+        child = fields[child].next_sibling) {
+      updateJsonFragment(request_arena, fields, child);
+      if (!fields[child].json_fragment.empty()) {
+        elements.push_back(&fields[child].json_fragment);
+        size += fields[child].json_fragment.size() + 2;
+      }
+    }
+    if (elements.empty()) {
+      return;
+    }
+    std::string& output = field->json_fragment;
+    output.reserve(size);
+    output.append(depth, ' ');
+    output += name;
+    output += "[\n";
+    for (size_t i = 0; i < elements.size(); i++) {
+      if (i > 0) {
+        output += ",\n";
+      }
+      output += *elements[i];
+    }
+    output += '\n';
+    output.append(depth, ' ');
+    output += ']';
+  } else if (field->hide_expand) {
+    field->json_fragment = std::string(depth, ' ') + name +
+        composeJsonObject(request_arena, fields, field_index, depth);
+  }
+}
+
+
+/**
+ * A request template compiled into the literal text between its placeholders
+ * and the variables named by the placeholders, so that scripts are written
+ * from it without searching the text again.
+ */
+class RequestTemplate {
+ public:
+  /**
+   * A span of literal text followed by a placeholder, if variable is not -1.
+   */
+  struct Segment {
+    size_t begin;
+    size_t length;
+    int variable;
+  };
+
+  /**
+   * Get the compiled template in a file, compiling it only if it changed
+   * since it was last compiled. Returns NULL if the file is not a regular
+   * file that can be read.
+   */
+  static std::shared_ptr<const RequestTemplate> load(const std::string& path) {
+    static std::unordered_map<std::string, std::shared_ptr<const RequestTemplate>> cache;
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      return NULL;
+    }
+#ifdef __APPLE__
+    int64_t mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    std::shared_ptr<const RequestTemplate>& cached = cache[path];
+    if (cached != NULL && cached->mtime == mtime && cached->size == st.st_size) {
+      return cached;
+    }
+
+    std::ifstream stream(path);
+    if (!stream) {
+      cache.erase(path);
+      return NULL;
+    }
+    std::shared_ptr<RequestTemplate> compiled(new RequestTemplate());
+    compiled->mtime = mtime;
+    compiled->size = st.st_size;
+    compiled->text.assign(std::istreambuf_iterator<char>(stream),
+        std::istreambuf_iterator<char>());
+    // Every line of the script ends in a newline.
+    if (!compiled->text.empty() && compiled->text.back() != '\n') {
+      compiled->text += '\n';
+    }
+    compiled->compile();
+    cached = compiled;
+    return cached;
+  }
+
+  /**
+   * The text of the template.
+   */
+  std::string text;
+
+  std::vector<Segment> segments;
+
+  /**
+   * The names of the variables in placeholders, in the order they first
+   * appear.
+   */
+  std::vector<std::string> variables;
+
+ private:
+  RequestTemplate() : mtime(0), size(0) {}
+
+  /**
+   * Split the text at placeholders of the form ###{NAME}, where the name is
+   * made of letters, digits, spaces, `-` and `_`.
+   */
+  void compile() {
+    static const std::string_view marker("###{");
+    std::unordered_map<std::string_view, int> variable_indexes;
+    std::string_view view(text);
+    size_t literal_begin = 0;
+    size_t position = 0;
+    while ((position = view.find(marker, position)) != std::string_view::npos) {
+      size_t name_begin = position + marker.size();
+      size_t name_end = name_begin;
+      while (name_end < view.size() && (isalnum((unsigned char)view[name_end]) ||
+            view[name_end] == '-' || view[name_end] == '_' || view[name_end] == ' ')) {
+        name_end++;
+      }
+      if (name_end == name_begin || name_end == view.size() || view[name_end] != '}') {
+        position++;
+        continue;
+      }
+      std::string_view name = view.substr(name_begin, name_end - name_begin);
+      auto inserted = variable_indexes.emplace(name, variables.size());
+      if (inserted.second) {
+        variables.emplace_back(name);
+      }
+      segments.push_back({literal_begin, position - literal_begin, inserted.first->second});
+      literal_begin = position = name_end + 1;
+    }
+    segments.push_back({literal_begin, view.size() - literal_begin, -1});
+  }
+
+  /**
+   * The modification time and size of the file when it was compiled.
+   */
+  int64_t mtime;
+  off_t size;
+};
+
+/**
+ * Get the values of the reserved template variables that depend only on the
+ * method, and not on the request.
+ */
+std::unordered_map<std::string, std::string> getMethodVariables(
+    const MethodDescriptor* method_descriptor,
+    const std::vector<const char*>& proto_dirs) {
+  std::unordered_map<std::string, std::string> variable_values;
+  std::string proto_dirs_cat;
+  for (const char* proto_dir: proto_dirs) {
+    proto_dirs_cat += proto_dir;
+    proto_dirs_cat += "\n";
+  }
+  if (!proto_dirs_cat.empty()) {
+    proto_dirs_cat.pop_back();
+  }
+  variable_values["PROTO_DIRS"] = proto_dirs_cat;
+  variable_values["SERVICE_PROTO_FILE"] = method_descriptor->file()->name();
+  variable_values["REQUEST_PROTO_FILE"] = method_descriptor->input_type()->file()->name();
+  variable_values["RESPONSE_PROTO_FILE"] = method_descriptor->output_type()->file()->name();
+  variable_values["FULL_SERVICE_NAME"] = method_descriptor->service()->full_name();
+  variable_values["SERVICE_NAME"] = method_descriptor->service()->name();
+  variable_values["FULL_METHOD_NAME"] = method_descriptor->full_name();
+  variable_values["METHOD_NAME"] = method_descriptor->name();
+  variable_values["FULL_REQUEST_NAME"] = method_descriptor->input_type()->full_name();
+  variable_values["FULL_RESPONSE_NAME"] = method_descriptor->output_type()->full_name();
+  return variable_values;
+}
 
 /**
  * Write a script that can perform Rpc requests against a particular dependency.
+ * method_variables holds the values of getMethodVariables() for the method.
+ * Returns the path of the script, or an empty string if the filename contains
+ * a single quote or the program was interrupted while asking for input.
  */
 std::string exportScript(
     std::string request_template,
     CDKSCREEN* cdk_screen,
+    RequestArena* request_arena,
     const MethodDescriptor* method_descriptor,
-    const std::vector<ProtoCDKField*> fields,
-    const std::vector<const char*> proto_dirs,
+    const ProtoCDKFieldTree& fields,
+    const std::unordered_map<std::string, std::string>& method_variables,
     int user_choose_filename = 0) {
-  static std::regex placeholder_expression("###\\{([-_ a-zA-Z0-9]+)\\}");
   // Ask for request template path if it was not given on the command line, or
   // the one given on the command line is not a valid file.
-  std::error_code ec;
-  while (request_template.empty() || !std::filesystem::is_regular_file(request_template, ec)) {
+  std::shared_ptr<const RequestTemplate> compiled_template;
+  while ((compiled_template = RequestTemplate::load(request_template)) == NULL) {
+    if (interrupted) {
+      return "";
+    }
     request_template = getInput(
         cdk_screen,
         /*title=*/"Please enter a valid path to the request template file. "
@@ -581,88 +1746,43 @@ std::string exportScript(
         /*label=*/"Request template file: ");
   }
 
-  // Read the template file and check for anything that matches the general
-  // pattern ###{}. These are variables that will be filled in by asking the
-  // user for them, unless it's one of the special variables with a reserved name.
-  std::vector<std::string> script_lines;
-  std::ifstream template_stream(request_template);
-  std::unordered_set<std::string> variables;
-  for (std::string line; std::getline(template_stream, line);) {
-    script_lines.push_back(line);
-    std::smatch match;
-    while (std::regex_search (line,match,placeholder_expression)) {
-      // Grab the first group which is the name of the variable.
-      variables.insert(match[1].str());
-      line = match.suffix().str();
-    }
-  }
-
-  static std::unordered_set<std::string> special_variables({
-    "JSON_REQUEST",
-    "BASE64_PROTO_REQUEST",
-    "PROTO_DIRS",
-    "SERVICE_PROTO_FILE",
-    "REQUEST_PROTO_FILE",
-    "RESPONSE_PROTO_FILE",
-    "FULL_SERVICE_NAME",
-    "SERVICE_NAME",
-    "FULL_METHOD_NAME",
-    "METHOD_NAME",
-    "FULL_REQUEST_NAME",
-    "FULL_RESPONSE_NAME"});
-  std::unordered_map<std::string, std::string> variable_values;
-  for (std::string variable : variables) {
-    // Ask for any variable without a reserved name.
-    if (special_variables.find(variable) == special_variables.end()) {
+  // Build the request at most once, for all of the variables that need it.
+  Message* request = NULL;
+  auto getRequest = [&]() {
+    if (request == NULL) {
+      request = request_arena->newMessage(method_descriptor->input_type());
+      // Populate message fields
+      populateMessageData(request, fields, ProtoCDKFieldTree::REQUEST);
+    }
+    return request;
+  };
+
+  // The variables in the template are filled in by asking the user for them,
+  // unless they have one of the reserved names.
+  const std::vector<std::string>& variables = compiled_template->variables;
+  std::vector<std::string> variable_values(variables.size());
+  for (size_t i = 0; i < variables.size(); i++) {
+    const std::string& variable = variables[i];
+    auto method_variable = method_variables.find(variable);
+    if (method_variable != method_variables.end()) {
+      variable_values[i] = method_variable->second;
+    } else if (variable == "JSON_REQUEST") {
+      variable_values[i] = getJsonMessage(getRequest());
+    } else if (variable == "BASE64_PROTO_REQUEST") {
+      Base64Escape(getRequest()->SerializeAsString(), &variable_values[i]);
+    } else {
       std::string prompt = "Please enter " + variable + ":";
-      std::string variable_value = getInput(
+      variable_values[i] = getInput(
           cdk_screen,
           /*title=*/prompt.c_str(),
           /*label=*/"");
-      variable_values[variable] = variable_value;
-    } else {
-      // Iterate the system generated variables in the template file and create
-      // them if they are asked for.
-      if (variable == "JSON_REQUEST") {
-        std::string json_message = getJsonMessage(method_descriptor->input_type(), fields);
-        variable_values[variable] = json_message;
-      } else if (variable == "BASE64_PROTO_REQUEST") {
-        Message* message = dynamic_message_factory.GetPrototype(method_descriptor->input_type())->New();
-        // Populate message fields
-        populateMessageData(message, fields);
-        std::string base64_binary_proto;
-        Base64Escape(message->SerializeAsString(), &base64_binary_proto);
-        variable_values[variable] = base64_binary_proto;
-      } else if (variable == "PROTO_DIRS") {
-        std::string proto_dirs_cat;
-        for (const char* proto_dir: proto_dirs) {
-          proto_dirs_cat += proto_dir;
-          proto_dirs_cat += "\n";
-        }
-        proto_dirs_cat.pop_back();
-        variable_values[variable] = proto_dirs_cat;
-      } else if (variable == "SERVICE_PROTO_FILE") {
-        variable_values[variable] = method_descriptor->file()->name();
-      } else if (variable == "REQUEST_PROTO_FILE") {
-        variable_values[variable] = method_descriptor->input_type()->file()->name();
-      } else if (variable == "RESPONSE_PROTO_FILE") {
-        variable_values[variable] = method_descriptor->output_type()->file()->name();
-      } else if (variable == "FULL_SERVICE_NAME") {
-        variable_values[variable] = method_descriptor->service()->full_name();
-      } else if (variable == "SERVICE_NAME") {
-        variable_values[variable] = method_descriptor->service()->name();
-      } else if (variable == "FULL_METHOD_NAME") {
-        variable_values[variable] = method_descriptor->full_name();
-      } else if (variable == "METHOD_NAME") {
-        variable_values[variable] = method_descriptor->name();
-      } else if (variable == "FULL_REQUEST_NAME") {
-        variable_values[variable] = method_descriptor->input_type()->full_name();
-      } else if (variable == "FULL_RESPONSE_NAME") {
-        variable_values[variable] = method_descriptor->output_type()->full_name();
-      }
     }
   }
 
+  if (interrupted) {
+    return "";
+  }
+
   // Ask for filename if caller said we should ask.
   std::string filename;
   if (user_choose_filename) {
@@ -671,25 +1791,29 @@ std::string exportScript(
         /*title=*/"Please enter the desired filename of the exported script:",
         /*label=*/"Filename: ");
 
-    while (filename.empty()) {
+    while (filename.empty() && !interrupted) {
       filename = getInput(
           cdk_screen,
           /*title=*/"Please enter the desired filename of the exported script:",
           /*label=*/"Filename: ");
     }
 
+    if (interrupted) {
+      return "";
+    }
+
     // Expand wildcards like ~ and variables in the filename, so that we can
     // support paths like `~/Desktop/get_merchant.sh`.
     wordexp_t word_expansion;
     int error = wordexp(filename.c_str(), &word_expansion, 0);
     if (error) {
-      debugMsg("wordexp failed with error code %d. Falling back to non-expanded "
-          "filename.\n", error);
+      debugMsg(DEBUG_SCRIPT, DEBUG_ERROR, "wordexp failed with error code %d. "
+          "Falling back to non-expanded filename.\n", error);
       if (error == WRDE_NOSPACE) {
         wordfree(&word_expansion);
       }
     } else if (word_expansion.we_wordc != 1) {
-      debugMsg("wordexp expanded to %lu != 1 words. "
+      debugMsg(DEBUG_SCRIPT, DEBUG_ERROR, "wordexp expanded to %lu != 1 words. "
           "Falling back to non-expanded filename.\n", word_expansion.we_wordc);
       wordfree(&word_expansion);
     } else {
@@ -710,24 +1834,24 @@ std::string exportScript(
     return "";
   }
 
-  std::ofstream script_file(filename);
-  for (std::string line: script_lines) {
-    // Single pass replacement of any variables
-    std::string output_line;
-    std::smatch match;
-    while (std::regex_search (line,match,placeholder_expression)) {
-      // Copy the part of the line before the match
-      output_line += match.prefix().str();
-      // Add the substitution based on the variable name.
-      output_line += variable_values[match[1].str()];
-      // Update the line to the remainder of the line
-      line = match.suffix().str();
-    }
-    output_line += line;
-
-    // Write the line out to the file.
-    script_file << output_line << std::endl;
+  // Fill in the placeholders in a single pass over the compiled template.
+  const std::string& text = compiled_template->text;
+  size_t script_size = text.size();
+  for (const RequestTemplate::Segment& segment : compiled_template->segments) {
+    if (segment.variable != -1) {
+      script_size += variable_values[segment.variable].size();
+    }
+  }
+  std::string script;
+  script.reserve(script_size);
+  for (const RequestTemplate::Segment& segment : compiled_template->segments) {
+    script.append(text, segment.begin, segment.length);
+    if (segment.variable != -1) {
+      script += variable_values[segment.variable];
+    }
   }
+  std::ofstream script_file(filename);
+  script_file.write(script.data(), script.size());
   return filename;
 }
 
@@ -794,14 +1918,17 @@ static void setFocus(CDKOBJS* obj) {
  * Show an information panel.
  */
 void showInfoPanel(CDKSCREEN* cdk_screen, const std::string& info) {
+  if (interrupted) {
+    return;
+  }
   CDKSWINDOW* window = newCDKSwindow(cdk_screen, LEFT, TOP, num_rows - ROWS_FOR_ONSCREEN_HELP,
       num_cols / 2, "", 100000, 1, 0);
   showMultilineMessage(window, info);
-  debugMsg("showInfoPanel: after showMultilineMessage.\n");
+  debugMsg(DEBUG_UI, DEBUG_TRACE, "showInfoPanel: after showMultilineMessage.\n");
   activateCDKSwindow(window, NULL);
-  debugMsg("showInfoPanel: after activateCDKSwindow.\n");
+  debugMsg(DEBUG_UI, DEBUG_TRACE, "showInfoPanel: after activateCDKSwindow.\n");
   destroyCDKSwindow(window);
-  debugMsg("showInfoPanel: after destroyCDKSwindow.\n");
+  debugMsg(DEBUG_UI, DEBUG_TRACE, "showInfoPanel: after destroyCDKSwindow.\n");
   // Restore previous contents of screen.
   refreshCDKScreen (cdk_screen);
 }
@@ -827,9 +1954,12 @@ std::string exec_cmd(const char* cmd) {
 }
 
 /**
- * Ask the user for input.
+ * Ask the user for input. Returns an empty string once interrupted.
  */
 std::string getInput(CDKSCREEN* cdk_screen, const char* title, const char* label) {
+  if (interrupted) {
+    return "";
+  }
   char* userValue;
   CDKENTRY * entry = newCDKEntry(cdk_screen,
       LEFT, CENTER,
@@ -838,1028 +1968,5023 @@ std::string getInput(CDKSCREEN* cdk_screen, const char* title, const char* label
       128, 0, 256,
       TRUE, FALSE);
   userValue = activateCDKEntry(entry, NULL);
-  while (entry->exitType != vNORMAL)
+  while (entry->exitType != vNORMAL && !interrupted)
   {
     userValue = activateCDKEntry(entry, NULL);
   }
   // Construct this before destruction, so we save a copy of the C String.
-  std::string retVal(userValue);
+  std::string retVal(interrupted ? "" : userValue);
   destroyCDKEntry(entry);
   refreshCDKScreen (cdk_screen);
   return retVal;
 }
 
 /**
- * Subclasses represent a full page cureses display and handle all rendering
- * and interactions with the user.
+ * Collects errors from building descriptors, so that they can be shown in the
+ * curses interface, which is running whenever descriptors are built.
  */
-class UserFacingPage {
+class BuildErrorCollector : public DescriptorPool::ErrorCollector {
 public:
+  virtual void AddError(const std::string& filename, const std::string& element_name,
+      const Message* descriptor, ErrorLocation location, const std::string& message) {
+    errors += "Error occured for " + filename + ":" + element_name + " " +
+        message + "\n";
+  }
+
   /**
-   * Consume a key from the user. This will be invoked after global hotkeys are
-   * examined and do not consume the key.
-   *
-   * Returning True means completed, so the caller should pop this screen off
-   * of the stack and destroy it.
+   * Return the errors reported since the last call and forget them.
    */
-  virtual bool handleInput(int keyCode, int functionKey) = 0;
-  virtual void redraw() = 0;
-  virtual ~UserFacingPage() {}
+  std::string takeErrors() {
+    std::string result;
+    result.swap(errors);
+    return result;
+  }
 
+private:
+  std::string errors;
+};
+
+/**
+ * An Rpc method that can be searched for.
+ */
+struct MethodEntry {
   /**
-   * Get the active object, needed for getting user input.
+   * The full name of the method, such as helloworld.Greeter.SayHello.
    */
-  virtual CDKOBJS* getCDKActiveObject() = 0;
+  std::string full_name;
+
+  /**
+   * The proto file that defines the method's service.
+   */
+  std::string file_name;
+
+  /**
+   * The descriptor of the method, or NULL if it has not been built yet.
+   */
+  mutable const MethodDescriptor* descriptor;
 };
 
 /**
- * A page where users can build requests interactively, make requests, and
- * export scripts.
+ * The set of Rpc methods that can be searched for, keyed by lowercase full
+ * name. In lazy mode, entries are added before their descriptors are built,
+ * and resolve() builds them on demand.
  */
-class RequestBuilderPage : public UserFacingPage {
+class MethodCatalog {
 public:
   /**
-   * Constructor. Will crash program on failures.
+   * Polled now and then during a search. Returning true stops the search,
+   * whose results are then incomplete and should be dropped.
    */
-  RequestBuilderPage(const MethodDescriptor* method_descriptor, const Options& options)
+  typedef std::function<bool()> CancelCheck;
+
+  MethodCatalog(const DescriptorPool* pool, BuildErrorCollector* error_collector)
+      : pool(pool), error_collector(error_collector), indexed(false) {}
+
+  /**
+   * Add a method. descriptor may be NULL if it has not been built yet.
+   */
+  void add(const std::string& full_name, const std::string& file_name,
+      const MethodDescriptor* descriptor) {
+    auto inserted = methods.emplace(tolower(full_name), MethodEntry());
+    MethodEntry& entry = inserted.first->second;
+    entry.full_name = full_name;
+    entry.file_name = file_name;
+    entry.descriptor = descriptor;
+    if (inserted.second) {
+      indexed = false;
+    }
+  }
+
+  /**
+   * Copy the lowercase names searched by search() into one contiguous block
+   * and index their trigrams, if methods were added since it was last done.
+   * Called once the catalog is filled, so that the first search does not do
+   * it.
+   */
+  void index() {
+    if (indexed) {
+      return;
+    }
+    names.clear();
+    offsets.clear();
+    entries.clear();
+    entries.reserve(methods.size());
+    offsets.reserve(methods.size() + 1);
+    for (const auto& name_and_entry : methods) {
+      offsets.push_back(names.size());
+      entries.push_back(&name_and_entry.second);
+      // Names never contain NUL, so a match never spans two names.
+      names += name_and_entry.first;
+      names += '\0';
+    }
+    offsets.push_back(names.size());
+    names.shrink_to_fit();
+    indexTrigrams();
+    indexed = true;
+  }
+
+  /**
+   * Find the best matches for tokens, which must be lowercase, best first. A
+   * method matches if each token is a subsequence of its full name. Methods
+   * that contain every token as a substring rank above the rest, and are
+   * ranked among themselves like the rest by score(). At most kMaxResults are
+   * returned, and match_count is set to the number of matches, including
+   * those that were cut. Without tokens, every method matches and they are
+   * returned in name order. If cancelled returns true, the search stops early.
+   */
+  std::vector<const MethodEntry*> search(const std::vector<std::string>& tokens,
+      size_t* match_count, const CancelCheck& cancelled = CancelCheck()) {
+    index();
+    if (tokens.empty()) {
+      *match_count = entries.size();
+      return entries;
+    }
+
+    // When there are enough substring matches, no other match can make it
+    // into the results, so only the substring matches need scoring.
+    // Otherwise only the names that the tokens are subsequences of are
+    // scored, which the scan for them finds without scoring the rest.
+    Canceller cancel(cancelled);
+    std::vector<uint32_t> substring_matches = findSubstringMatches(tokens, cancel);
+    TopMatches top;
+    if (substring_matches.size() >= kMaxResults) {
+      for (uint32_t id : substring_matches) {
+        if (cancel()) {
+          break;
+        }
+        top.offer(getName(id), entries[id], tokens);
+      }
+      *match_count = findSubsequenceMatches(tokens, cancel).size();
+    } else {
+      for (uint32_t id : findSubsequenceMatches(tokens, cancel)) {
+        if (cancel()) {
+          break;
+        }
+        top.offer(getName(id), entries[id], tokens);
+      }
+      *match_count = top.matches;
+    }
+    return top.take();
+  }
+
+  /**
+   * Rank candidates like search() does, keeping only the matches. This
+   * narrows down the complete results of a search to those of a more
+   * specific one. If cancelled returns true, ranking stops early.
+   */
+  static std::vector<const MethodEntry*> rank(const std::vector<const MethodEntry*>& candidates,
+      const std::vector<std::string>& tokens, size_t* match_count,
+      const CancelCheck& cancelled = CancelCheck()) {
+    Canceller cancel(cancelled);
+    TopMatches top;
+    for (const MethodEntry* candidate : candidates) {
+      if (cancel()) {
+        break;
+      }
+      top.offer(tolower(candidate->full_name), candidate, tokens);
+    }
+    *match_count = top.matches;
+    return top.take();
+  }
+
+  /**
+   * Get the descriptor of a method, building the file that defines it and the
+   * dependencies of that file first if needed. Returns NULL and sets error if
+   * the file fails to build.
+   */
+  const MethodDescriptor* resolve(const MethodEntry* entry, std::string* error) const {
+    if (entry->descriptor == NULL) {
+      if (pool->FindFileByName(entry->file_name) != NULL) {
+        entry->descriptor = pool->FindMethodByName(entry->full_name);
+      }
+      if (entry->descriptor == NULL) {
+        *error = "Failed to load " + entry->full_name + " from " +
+            entry->file_name + ".\n" + error_collector->takeErrors();
+      }
+    }
+    return entry->descriptor;
+  }
+
+  /**
+   * The method with the given full name, or NULL if there is none.
+   */
+  const MethodEntry* find(const std::string& full_name) const {
+    auto it = methods.find(tolower(full_name));
+    return it == methods.end() ? NULL : &it->second;
+  }
+
+  const std::map<std::string, MethodEntry>& getMethods() const {
+    return methods;
+  }
+
+private:
+  /**
+   * The pool that descriptors are built from.
+   */
+  const DescriptorPool* pool;
+
+  /**
+   * The error collector of pool, for explaining failures to resolve.
+   */
+  BuildErrorCollector* error_collector;
+
+  /**
+   * The most matches that a search returns, which keeps ranking cheap and the
+   * result list short enough to look through.
+   */
+  static const size_t kMaxResults = 1000;
+
+  /**
+   * Calls a CancelCheck once every kCancelCheckInterval steps of a search,
+   * since checking may cost a system call, and stays cancelled once it
+   * returned true.
+   */
+  class Canceller {
+  public:
+    explicit Canceller(const CancelCheck& check)
+        : check(check), steps(0), cancelled(false) {}
+
+    bool operator()() {
+      if (!cancelled && check && ++steps % kCancelCheckInterval == 0) {
+        cancelled = check();
+      }
+      return cancelled;
+    }
+
+  private:
+    static const int kCancelCheckInterval = 1024;
+
+    CancelCheck check;
+    int steps;
+    bool cancelled;
+  };
+
+  /**
+   * A method that matches a search, with how well it matches.
+   */
+  struct Match {
+    /**
+     * 1 if every token is a substring of the name, 0 otherwise.
+     */
+    int tier;
+    int score;
+    const MethodEntry* entry;
+
+    bool operator<(const Match& other) const {
+      if (tier != other.tier) {
+        return tier > other.tier;
+      }
+      if (score != other.score) {
+        return score > other.score;
+      }
+      if (entry->full_name.size() != other.entry->full_name.size()) {
+        return entry->full_name.size() < other.entry->full_name.size();
+      }
+      return entry->full_name < other.entry->full_name;
+    }
+  };
+
+  /**
+   * Keeps the best kMaxResults matches offered to it in a heap, whose top is
+   * the worst match kept, so each offer costs at most a logarithm.
+   */
+  struct TopMatches {
+    TopMatches() : matches(0) {}
+
+    void offer(std::string_view lowercase_name, const MethodEntry* entry,
+        const std::vector<std::string>& tokens) {
+      Match match = {1, 0, entry};
+      for (const std::string& token : tokens) {
+        bool substring;
+        int token_score = score(lowercase_name, entry->full_name, token, &substring);
+        if (token_score < 0) {
+          return;
+        }
+        match.score += token_score;
+        if (!substring) {
+          match.tier = 0;
+        }
+      }
+      matches++;
+      if (heap.size() < kMaxResults) {
+        heap.push_back(match);
+        std::push_heap(heap.begin(), heap.end());
+      } else if (match < heap.front()) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = match;
+        std::push_heap(heap.begin(), heap.end());
+      }
+    }
+
+    /**
+     * The kept matches, best first.
+     */
+    std::vector<const MethodEntry*> take() {
+      std::sort_heap(heap.begin(), heap.end());
+      std::vector<const MethodEntry*> found;
+      for (const Match& match : heap) {
+        found.push_back(match.entry);
+      }
+      heap.clear();
+      return found;
+    }
+
+    /**
+     * The number of matches offered, including those that were dropped.
+     */
+    size_t matches;
+
+  private:
+    std::vector<Match> heap;
+  };
+
+  /**
+   * Score how well token matches a method name, in the spirit of fzf, or
+   * return -1 if token is not a subsequence of the name. Matched characters
+   * score more when they are consecutive, start a component or a CamelCase
+   * hump, or are in the method or service name rather than the package.
+   * Every start of the token in the name is tried, and the best alignment
+   * found greedily from one of them wins. substring is set to whether the
+   * token occurs in the name as a whole.
+   */
+  static int score(std::string_view lowercase_name, const std::string& name,
+      const std::string& token, bool* substring) {
+    *substring = lowercase_name.find(token) != std::string_view::npos;
+    if (token.empty()) {
+      return 0;
+    }
+    size_t method_start = name.rfind('.');
+    method_start = method_start == std::string::npos ? 0 : method_start + 1;
+    size_t service_start = method_start == 0 ? 0 : name.rfind('.', method_start - 2);
+    service_start = service_start == std::string::npos ? 0 : service_start + 1;
+
+    int best = -1;
+    for (size_t start = lowercase_name.find(token[0]); start != std::string_view::npos;
+        start = lowercase_name.find(token[0], start + 1)) {
+      int total = 0;
+      size_t position = start;
+      size_t previous = std::string::npos;
+      size_t matched = 0;
+      for (; matched < token.size(); matched++, position++) {
+        position = lowercase_name.find(token[matched], position);
+        if (position == std::string_view::npos) {
+          break;
+        }
+        total += 16;
+        if (previous != std::string::npos) {
+          total += position == previous + 1 ? 8 : -std::min<int>(position - previous - 1, 8);
+        }
+        if (position == 0 || strchr("._/", name[position - 1]) != NULL) {
+          total += 12;
+        } else if (isupper((unsigned char) name[position]) &&
+            !isupper((unsigned char) name[position - 1])) {
+          total += 10;
+        }
+        if (position >= method_start) {
+          total += 6;
+        } else if (position >= service_start) {
+          total += 3;
+        }
+        previous = position;
+      }
+      if (matched < token.size()) {
+        // Later starts leave even less of the name to match the token in.
+        break;
+      }
+      best = std::max(best, total);
+    }
+    return best;
+  }
+
+  /**
+   * The ids of the methods whose lowercase full names contain every one of
+   * tokens, in name order. Only the candidates of the trigram index are
+   * checked when it narrows the search down. Otherwise, such as for tokens
+   * shorter than a trigram, the names are scanned for the longest token,
+   * which is likely the rarest, and the other tokens are checked in the names
+   * that contain it.
+   */
+  std::vector<uint32_t> findSubstringMatches(const std::vector<std::string>& tokens,
+      Canceller& cancel) const {
+    std::vector<uint32_t> candidates;
+    if (findTrigramCandidates(tokens, &candidates)) {
+      std::vector<uint32_t> found;
+      for (uint32_t id : candidates) {
+        if (cancel()) {
+          break;
+        }
+        std::string_view name = getName(id);
+        if (std::all_of(tokens.begin(), tokens.end(), [name](const std::string& token) {
+              return name.find(token) != std::string_view::npos;
+            })) {
+          found.push_back(id);
+        }
+      }
+      return found;
+    }
+
+    const std::string* longest = &tokens[0];
+    for (const std::string& token : tokens) {
+      if (token.size() > longest->size()) {
+        longest = &token;
+      }
+    }
+    std::vector<uint32_t> found;
+    size_t position = 0;
+    while (!cancel() && (position = findInNames(*longest, position)) != std::string::npos) {
+      uint32_t id = std::upper_bound(offsets.begin(), offsets.end(), position) - offsets.begin() - 1;
+      std::string_view name = getName(id);
+      bool match = true;
+      for (const std::string& token : tokens) {
+        if (&token != longest && name.find(token) == std::string_view::npos) {
+          match = false;
+          break;
+        }
+      }
+      if (match) {
+        found.push_back(id);
+      }
+      position = offsets[id + 1];
+    }
+    return found;
+  }
+
+  /**
+   * The ids of the methods whose lowercase full names have every one of
+   * tokens as a subsequence, in name order. names is scanned with memchr for
+   * the first byte of the longest token, so that the names without it are
+   * skipped a block at a time, and only the names with it are checked.
+   */
+  std::vector<uint32_t> findSubsequenceMatches(const std::vector<std::string>& tokens,
+      Canceller& cancel) const {
+    const std::string* longest = &tokens[0];
+    for (const std::string& token : tokens) {
+      if (token.size() > longest->size()) {
+        longest = &token;
+      }
+    }
+    std::vector<uint32_t> found;
+    if (longest->empty()) {
+      for (uint32_t id = 0; id < entries.size(); id++) {
+        found.push_back(id);
+      }
+      return found;
+    }
+    size_t position = 0;
+    while (position < names.size() && !cancel()) {
+      const char* hit = (const char*) memchr(names.data() + position, (*longest)[0],
+          names.size() - position);
+      if (hit == NULL) {
+        break;
+      }
+      uint32_t id = std::upper_bound(offsets.begin(), offsets.end(),
+          hit - names.data()) - offsets.begin() - 1;
+      std::string_view name = getName(id);
+      if (std::all_of(tokens.begin(), tokens.end(), [name](const std::string& token) {
+            return isSubsequence(token, name);
+          })) {
+        found.push_back(id);
+      }
+      position = offsets[id + 1];
+    }
+    return found;
+  }
+
+  /**
+   * Whether the characters of token occur in name in order.
+   */
+  static bool isSubsequence(const std::string& token, std::string_view name) {
+    size_t position = 0;
+    for (char c : token) {
+      position = name.find(c, position);
+      if (position == std::string_view::npos) {
+        return false;
+      }
+      position++;
+    }
+    return true;
+  }
+
+  /**
+   * The position of the first occurrence of needle in names at or after
+   * start, or npos. With SSE2, 16 positions are checked at once by comparing
+   * their bytes to the first byte of needle, and the bytes needle.size() - 1
+   * further on to its last byte, so that the few positions where both match
+   * are all that need comparing in full.
+   */
+  size_t findInNames(const std::string& needle, size_t start) const {
+    size_t length = needle.size();
+    if (length == 0) {
+      return start < names.size() ? start : std::string::npos;
+    }
+    const char* text = names.data();
+    size_t position = start;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    for (; position + length - 1 + 16 <= names.size(); position += 16) {
+      __m128i first_block = _mm_loadu_si128((const __m128i*) (text + position));
+      __m128i last_block = _mm_loadu_si128((const __m128i*) (text + position + length - 1));
+      unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+          _mm_cmpeq_epi8(first_block, first), _mm_cmpeq_epi8(last_block, last)));
+      while (mask != 0) {
+        size_t candidate = position + __builtin_ctz(mask);
+        if (memcmp(text + candidate, needle.data(), length) == 0) {
+          return candidate;
+        }
+        mask &= mask - 1;
+      }
+    }
+#endif
+    return std::string_view(names).find(needle, position);
+  }
+
+  std::string_view getName(uint32_t id) const {
+    return std::string_view(names.data() + offsets[id], offsets[id + 1] - offsets[id] - 1);
+  }
+
+  /**
+   * The key of the trigram at offset in text. Each byte is packed into 6 bits,
+   * which keeps the letters, digits, '.' and '_' of names apart, so that the
+   * keys are dense enough to count in an array. Other bytes may share a code,
+   * which only adds candidates that are checked anyway.
+   */
+  static uint32_t trigram(std::string_view text, size_t offset) {
+    return trigramCode(text[offset]) << 12 | trigramCode(text[offset + 1]) << 6 |
+        trigramCode(text[offset + 2]);
+  }
+
+  static uint32_t trigramCode(char c) {
+    unsigned char byte = c;
+    if (byte >= 'a' && byte <= 'z') {
+      return byte - 'a' + 1;
+    } else if (byte >= '0' && byte <= '9') {
+      return byte - '0' + 27;
+    } else if (byte == '.') {
+      return 37;
+    } else if (byte == '_') {
+      return 38;
+    }
+    return 39 + byte % 25;
+  }
+
+  static const uint32_t kTrigramKeys = 1 << 18;
+
+  /**
+   * Set trigrams to the distinct trigram keys of a name or token, in
+   * ascending order.
+   */
+  static void trigramsOf(std::string_view text, std::vector<uint32_t>* trigrams) {
+    trigrams->clear();
+    for (size_t i = 0; i + 3 <= text.size(); i++) {
+      trigrams->push_back(trigram(text, i));
+    }
+    std::sort(trigrams->begin(), trigrams->end());
+    trigrams->erase(std::unique(trigrams->begin(), trigrams->end()), trigrams->end());
+  }
+
+  /**
+   * Fill the posting lists of the trigrams of names. The lists are stored
+   * back to back, so that they take little more memory than the ids in them.
+   * Counting first lets each list be filled in id order without sorting, and
+   * remembering the last id posted to each list keeps trigrams that repeat
+   * within a name from being posted twice.
+   */
+  void indexTrigrams() {
+    std::vector<uint32_t> last_posted(kTrigramKeys, UINT32_MAX);
+    trigram_offsets.assign(kTrigramKeys + 1, 0);
+    for (uint32_t id = 0; id < entries.size(); id++) {
+      std::string_view name = getName(id);
+      for (size_t i = 0; i + 3 <= name.size(); i++) {
+        uint32_t key = trigram(name, i);
+        if (last_posted[key] != id) {
+          last_posted[key] = id;
+          trigram_offsets[key + 1]++;
+        }
+      }
+    }
+    for (uint32_t key = 0; key < kTrigramKeys; key++) {
+      trigram_offsets[key + 1] += trigram_offsets[key];
+    }
+    trigram_ids.resize(trigram_offsets[kTrigramKeys]);
+    trigram_ids.shrink_to_fit();
+    // Where the next id of each list goes.
+    std::vector<uint32_t> next(trigram_offsets.begin(), trigram_offsets.end() - 1);
+    last_posted.assign(kTrigramKeys, UINT32_MAX);
+    for (uint32_t id = 0; id < entries.size(); id++) {
+      std::string_view name = getName(id);
+      for (size_t i = 0; i + 3 <= name.size(); i++) {
+        uint32_t key = trigram(name, i);
+        if (last_posted[key] != id) {
+          last_posted[key] = id;
+          trigram_ids[next[key]++] = id;
+        }
+      }
+    }
+  }
+
+  /**
+   * Set candidates to the ascending ids of the methods whose names contain
+   * every trigram of tokens, intersecting the posting lists from the
+   * shortest. Returns false if the index does not narrow the search down
+   * enough to beat scanning names, because the tokens have no trigrams or
+   * even their rarest trigram is in many names.
+   */
+  bool findTrigramCandidates(const std::vector<std::string>& tokens,
+      std::vector<uint32_t>* candidates) const {
+    std::vector<std::pair<const uint32_t*, const uint32_t*>> lists;
+    std::vector<uint32_t> trigrams;
+    for (const std::string& token : tokens) {
+      trigramsOf(token, &trigrams);
+      for (uint32_t token_trigram : trigrams) {
+        lists.emplace_back(trigram_ids.data() + trigram_offsets[token_trigram],
+            trigram_ids.data() + trigram_offsets[token_trigram + 1]);
+      }
+    }
+    if (lists.empty()) {
+      return false;
+    }
+    std::sort(lists.begin(), lists.end(),
+        [](const std::pair<const uint32_t*, const uint32_t*>& a,
+            const std::pair<const uint32_t*, const uint32_t*>& b) {
+          return a.second - a.first < b.second - b.first;
+        });
+    if ((size_t) (lists[0].second - lists[0].first) > entries.size() / kMaxTrigramShare) {
+      return false;
+    }
+    candidates->assign(lists[0].first, lists[0].second);
+    std::vector<uint32_t> intersection;
+    for (size_t i = 1; i < lists.size() && !candidates->empty(); i++) {
+      intersection.clear();
+      std::set_intersection(candidates->begin(), candidates->end(),
+          lists[i].first, lists[i].second, std::back_inserter(intersection));
+      candidates->swap(intersection);
+    }
+    return true;
+  }
+
+  std::map<std::string, MethodEntry> methods;
+
+  /**
+   * Whether names, offsets and entries cover every method.
+   */
+  bool indexed;
+
+  /**
+   * The lowercase full names of the methods in name order, each followed by
+   * a NUL, where the name of the method with id i starts at offsets[i].
+   * offsets ends with the size of names. Scanning one block is much faster
+   * than visiting the names in the nodes of methods.
+   */
+  std::string names;
+  std::vector<uint32_t> offsets;
+
+  /**
+   * The methods in name order, so that entries[i] is the method with id i.
+   */
+  std::vector<const MethodEntry*> entries;
+
+  /**
+   * The trigram index of names. The ascending ids of the methods whose names
+   * contain the trigram with key k are trigram_ids[trigram_offsets[k]] up to
+   * trigram_ids[trigram_offsets[k + 1]].
+   */
+  std::vector<uint32_t> trigram_offsets;
+  std::vector<uint32_t> trigram_ids;
+
+  /**
+   * The trigram index is only used when the rarest trigram of a search is in
+   * at most one in this many names. Checking more candidates than that one
+   * by one is slower than scanning every name.
+   */
+  static const size_t kMaxTrigramShare = 8;
+};
+
+/**
+ * Parsed proto files by virtual filename. The files are immutable and shared,
+ * so that generations can be built from the same files without copying them.
+ */
+typedef std::map<std::string, std::shared_ptr<const FileDescriptorProto>> FileMap;
+
+/**
+ * A DescriptorDatabase over a snapshot of a FileMap.
+ */
+class SharedFileDatabase : public DescriptorDatabase {
+public:
+  SharedFileDatabase(const FileMap& files) : files(files) {
+    // Index the top level symbols of each file. Nested symbols are found by
+    // looking up their enclosing top level symbol.
+    for (const auto& name_and_file : files) {
+      const FileDescriptorProto& file = *name_and_file.second;
+      std::string prefix = file.package().empty() ? "" : file.package() + ".";
+      for (const auto& message : file.message_type()) {
+        symbols[prefix + message.name()] = &file;
+      }
+      for (const auto& enum_type : file.enum_type()) {
+        symbols[prefix + enum_type.name()] = &file;
+        // Enum values are scoped like siblings of their enum.
+        for (const auto& value : enum_type.value()) {
+          symbols[prefix + value.name()] = &file;
+        }
+      }
+      for (const auto& service : file.service()) {
+        symbols[prefix + service.name()] = &file;
+      }
+      for (const auto& extension : file.extension()) {
+        symbols[prefix + extension.name()] = &file;
+      }
+    }
+  }
+
+  virtual bool FindFileByName(const std::string& filename, FileDescriptorProto* output) {
+    auto it = files.find(filename);
+    if (it == files.end()) {
+      return false;
+    }
+    output->CopyFrom(*it->second);
+    return true;
+  }
+
+  virtual bool FindFileContainingSymbol(const std::string& symbol_name,
+      FileDescriptorProto* output) {
+    std::string name = symbol_name;
+    while (true) {
+      auto it = symbols.find(name);
+      if (it != symbols.end()) {
+        output->CopyFrom(*it->second);
+        return true;
+      }
+      size_t dot = name.rfind('.');
+      if (dot == std::string::npos) {
+        return false;
+      }
+      name.resize(dot);
+    }
+  }
+
+  virtual bool FindFileContainingExtension(const std::string& containing_type,
+      int field_number, FileDescriptorProto* output) {
+    return false;
+  }
+
+  virtual bool FindAllFileNames(std::vector<std::string>* output) {
+    for (const auto& name_and_file : files) {
+      output->push_back(name_and_file.first);
+    }
+    return true;
+  }
+
+  const FileMap& getFiles() const {
+    return files;
+  }
+
+private:
+  FileMap files;
+  std::unordered_map<std::string, const FileDescriptorProto*> symbols;
+};
+
+/**
+ * Maps the names of fields, messages and enums to the methods whose request or
+ * response contains them, directly or nested, for searches such as
+ * field:idempotency_key. It is computed from the parsed files rather than
+ * descriptors, so that it is available before anything is built.
+ *
+ * Types only record which types refer to them and which methods take or
+ * return them. The methods that reach a type are found by following those
+ * references back when a type is first searched for, and are kept for every
+ * later search, so that searches only merge the methods of the matching types.
+ */
+class TypeIndex {
+public:
+  TypeIndex() : type_count(0), visit_epoch(0) {}
+
+  /**
+   * Index the methods of catalog, whose files and imports are in files.
+   */
+  void build(const FileMap& files, const MethodCatalog& catalog) {
+    for (const auto& name_and_file : files) {
+      const FileDescriptorProto& file = *name_and_file.second;
+      uint32_t scope = internScope(file.package());
+      for (const DescriptorProto& message : file.message_type()) {
+        addMessage(file.package(), scope, message);
+      }
+      for (const EnumDescriptorProto& enum_type : file.enum_type()) {
+        addType(file.package(), enum_type.name());
+      }
+    }
+    referrers.resize(type_count);
+    for (const PendingField& field : pending_fields) {
+      int type = resolve(field.scope, *field.type_name);
+      if (type >= 0 && (referrers[type].empty() || referrers[type].back() != field.owner)) {
+        referrers[type].push_back(field.owner);
+      }
+    }
+    pending_fields.clear();
+
+    direct_methods.resize(type_count);
+    for (const auto& name_and_file : files) {
+      const FileDescriptorProto& file = *name_and_file.second;
+      std::string prefix = file.package().empty() ? "" : file.package() + ".";
+      uint32_t scope = internScope(file.package());
+      for (const auto& service : file.service()) {
+        for (const auto& method : service.method()) {
+          const MethodEntry* entry =
+              catalog.find(prefix + service.name() + "." + method.name());
+          if (entry == NULL) {
+            continue;
+          }
+          for (int type : {resolve(scope, method.input_type()),
+              resolve(scope, method.output_type())}) {
+            if (type >= 0) {
+              direct_methods[type].push_back(entry);
+            }
+          }
+        }
+      }
+    }
+    resolved.clear();
+
+    reaching.assign(type_count, std::vector<const MethodEntry*>());
+    reached.assign(type_count, false);
+    visit_marks.assign(type_count, 0);
+  }
+
+  /**
+   * The methods that contain a field whose lowercase name starts with prefix,
+   * sorted by address.
+   */
+  std::vector<const MethodEntry*> findByField(const std::string& prefix) {
+    return methodsReaching(findByPrefix(field_types, prefix));
+  }
+
+  /**
+   * The methods that contain a message or enum whose lowercase name or full
+   * name starts with prefix, sorted by address.
+   */
+  std::vector<const MethodEntry*> findByType(const std::string& prefix) {
+    return methodsReaching(findByPrefix(name_types, prefix));
+  }
+
+  /**
+   * The methods that take or return the message or enum with the given
+   * lowercase full name, directly or nested, sorted by address. A name
+   * without a package also matches every type with that name.
+   */
+  std::vector<const MethodEntry*> findUsers(const std::string& name) {
+    auto it = name_types.find(!name.empty() && name[0] == '.' ? name.substr(1) : name);
+    if (it == name_types.end()) {
+      return std::vector<const MethodEntry*>();
+    }
+    return methodsReaching(it->second);
+  }
+
+private:
+  /**
+   * A field of a message whose type is yet to be resolved, since it may be
+   * defined in a file that has not been indexed yet.
+   */
+  struct PendingField {
+    uint32_t owner;
+
+    /**
+     * The innermost enclosing scope that defines types, in scopes.
+     */
+    uint32_t scope;
+
+    /**
+     * Points into the files being indexed.
+     */
+    const std::string* type_name;
+  };
+
+  /**
+   * Type ids by lowercase name.
+   */
+  typedef std::unordered_map<std::string, std::vector<uint32_t>> NameIndex;
+
+  uint32_t internScope(const std::string& scope) {
+    auto inserted = scope_ids.emplace(scope, scopes.size());
+    if (inserted.second) {
+      scopes.push_back(scope);
+    }
+    return inserted.first->second;
+  }
+
+  int addType(const std::string& scope, const std::string& name) {
+    std::string full_name = scope.empty() ? name : scope + "." + name;
+    auto inserted = type_ids.emplace(full_name, type_count);
+    if (inserted.second) {
+      name_types[tolower(name)].push_back(type_count);
+      name_types[tolower(full_name)].push_back(type_count);
+      type_count++;
+    }
+    return inserted.first->second;
+  }
+
+  void addMessage(const std::string& scope, uint32_t lookup_scope,
+      const DescriptorProto& message) {
+    uint32_t id = addType(scope, message.name());
+    std::string full_name = scope.empty() ? message.name() : scope + "." + message.name();
+    // A name cannot refer to a type in a message without nested types, so
+    // the fields of such messages are resolved from the enclosing scope,
+    // which lets the messages of a package share resolutions.
+    if (message.nested_type_size() > 0 || message.enum_type_size() > 0) {
+      lookup_scope = internScope(full_name);
+    }
+    for (const auto& field : message.field()) {
+      lowercase.assign(field.name());
+      std::transform(lowercase.begin(), lowercase.end(), lowercase.begin(),
+          [](unsigned char c){ return std::tolower(c); });
+      auto it = field_types.find(lowercase);
+      if (it == field_types.end()) {
+        it = field_types.emplace(lowercase, std::vector<uint32_t>()).first;
+      }
+      if (it->second.empty() || it->second.back() != id) {
+        it->second.push_back(id);
+      }
+      if (!field.type_name().empty()) {
+        pending_fields.push_back({id, lookup_scope, &field.type_name()});
+      }
+    }
+    for (const DescriptorProto& nested : message.nested_type()) {
+      addMessage(full_name, lookup_scope, nested);
+    }
+    for (const EnumDescriptorProto& enum_type : message.enum_type()) {
+      addType(full_name, enum_type.name());
+    }
+  }
+
+  /**
+   * The id of the type that type_name refers to from within scope, or -1.
+   * Resolutions are memoized, since the fields of a package mostly refer to
+   * the same few types.
+   */
+  int resolve(uint32_t scope, const std::string& type_name) {
+    lowercase.assign(type_name);
+    lowercase.push_back('\0');
+    lowercase.append((const char*) &scope, sizeof(scope));
+    auto memo = resolved.find(lowercase);
+    if (memo != resolved.end()) {
+      return memo->second;
+    }
+    int type = resolveInScope(scopes[scope], type_name);
+    resolved.emplace(lowercase, type);
+    return type;
+  }
+
+  /**
+   * Relative names are looked up in scope and then each enclosing scope, like
+   * protoc does, except that protoc only does so for the first component.
+   */
+  int resolveInScope(std::string scope, const std::string& type_name) const {
+    if (!type_name.empty() && type_name[0] == '.') {
+      auto it = type_ids.find(type_name.substr(1));
+      return it == type_ids.end() ? -1 : it->second;
+    }
+    while (true) {
+      auto it = type_ids.find(scope.empty() ? type_name : scope + "." + type_name);
+      if (it != type_ids.end()) {
+        return it->second;
+      }
+      if (scope.empty()) {
+        return -1;
+      }
+      size_t dot = scope.rfind('.');
+      scope.resize(dot == std::string::npos ? 0 : dot);
+    }
+  }
+
+  /**
+   * The types whose name in index starts with prefix. There are far fewer
+   * distinct names than fields, so checking each name is fast enough.
+   */
+  static std::vector<uint32_t> findByPrefix(const NameIndex& index,
+      const std::string& prefix) {
+    std::vector<uint32_t> found;
+    for (const auto& name_and_types : index) {
+      if (name_and_types.first.compare(0, prefix.size(), prefix) == 0) {
+        found.insert(found.end(), name_and_types.second.begin(), name_and_types.second.end());
+      }
+    }
+    return found;
+  }
+
+  /**
+   * The methods that reach any of types, sorted by address.
+   */
+  std::vector<const MethodEntry*> methodsReaching(const std::vector<uint32_t>& types) {
+    if (types.size() == 1) {
+      return methodsReaching(types[0]);
+    }
+    std::vector<const MethodEntry*> found;
+    for (uint32_t type : types) {
+      const std::vector<const MethodEntry*>& methods = methodsReaching(type);
+      found.insert(found.end(), methods.begin(), methods.end());
+    }
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+  }
+
+  /**
+   * The methods that reach type, sorted by address. They are found by
+   * following the references to the type back to the requests and responses
+   * of methods the first time, and memoized. The walk takes the methods of
+   * the types it meets that are already memoized instead of walking on.
+   */
+  const std::vector<const MethodEntry*>& methodsReaching(uint32_t type) {
+    if (reached[type]) {
+      return reaching[type];
+    }
+    visit_epoch++;
+    visit_marks[type] = visit_epoch;
+    pending_types.assign(1, type);
+    std::vector<const MethodEntry*> found;
+    while (!pending_types.empty()) {
+      uint32_t current = pending_types.back();
+      pending_types.pop_back();
+      if (current != type && reached[current]) {
+        found.insert(found.end(), reaching[current].begin(), reaching[current].end());
+        continue;
+      }
+      found.insert(found.end(), direct_methods[current].begin(), direct_methods[current].end());
+      for (uint32_t referrer : referrers[current]) {
+        if (visit_marks[referrer] != visit_epoch) {
+          visit_marks[referrer] = visit_epoch;
+          pending_types.push_back(referrer);
+        }
+      }
+    }
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    reaching[type] = std::move(found);
+    reached[type] = true;
+    return reaching[type];
+  }
+
+  /**
+   * Type ids by full name without a leading dot.
+   */
+  std::unordered_map<std::string, uint32_t> type_ids;
+  uint32_t type_count;
+
+  /**
+   * The scopes that fields are resolved in, and their ids.
+   */
+  std::vector<std::string> scopes;
+  std::unordered_map<std::string, uint32_t> scope_ids;
+
+  /**
+   * State that is only used while building.
+   */
+  std::vector<PendingField> pending_fields;
+  std::unordered_map<std::string, int> resolved;
+  std::string lowercase;
+
+  /**
+   * The messages that declare a field, and the messages and enums with a
+   * name or full name.
+   */
+  NameIndex field_types;
+  NameIndex name_types;
+
+  /**
+   * The messages with fields of each type, and the methods that take or
+   * return each type.
+   */
+  std::vector<std::vector<uint32_t>> referrers;
+  std::vector<std::vector<const MethodEntry*>> direct_methods;
+
+  /**
+   * The methods that reach each type, for the types in reached.
+   */
+  std::vector<std::vector<const MethodEntry*>> reaching;
+  std::vector<bool> reached;
+
+  /**
+   * The types visited by a walk are marked with its visit_epoch, so that
+   * walks do not need to clear the marks.
+   */
+  std::vector<uint32_t> visit_marks;
+  uint32_t visit_epoch;
+  std::vector<uint32_t> pending_types;
+};
+
+/**
+ * Parse filename from the proto paths, keeping its source info. Returns NULL
+ * if the file cannot be read or does not parse.
+ */
+static std::shared_ptr<const FileDescriptorProto> parseWithSourceInfo(
+    const std::vector<const char*>& proto_paths, const std::string& filename) {
+  class SilentErrorCollector : public google::protobuf::io::ErrorCollector {
+  public:
+    virtual void AddError(int line, int column, const std::string& message) {}
+  };
+
+  DiskSourceTree source_tree;
+  for (const char* proto_path : proto_paths) {
+    source_tree.MapPath("", proto_path);
+  }
+  std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> input(
+      source_tree.Open(filename));
+  if (input == NULL) {
+    return NULL;
+  }
+  SilentErrorCollector error_collector;
+  google::protobuf::io::Tokenizer tokenizer(input.get(), &error_collector);
+  Parser parser;
+  parser.RecordErrorsTo(&error_collector);
+  std::shared_ptr<FileDescriptorProto> file(new FileDescriptorProto());
+  file->set_name(filename);
+  if (!parser.Parse(&tokenizer, file.get())) {
+    return NULL;
+  }
+  return file;
+}
+
+/**
+ * Everything built from one version of the proto files. Reloading changed
+ * files produces a new generation rather than modifying this one, because
+ * descriptors cannot be removed from a DescriptorPool. Pages hold on to the
+ * generation that their descriptors came from.
+ */
+struct ProtoGeneration {
+  ProtoGeneration(const FileMap& files, const Options& options)
+      : database(files)
+      , pool(&database, &error_collector)
+      , message_factory(&pool)
+      , catalog(&pool, &error_collector)
+      , options(options) {}
+
+  /**
+   * The definition of descriptor, which is from pool, including comments.
+   * With --lazy_comments the files in pool have no comments, so the file of
+   * descriptor is parsed again and built into a pool of its own, which is
+   * kept for showing more definitions from the same file.
+   */
+  template <typename DescriptorType>
+  std::string describe(const DescriptorType* descriptor) {
+    DebugStringOptions debug_string_options;
+    debug_string_options.include_comments = true;
+    if (options.lazy_comments) {
+      const DescriptorPool* commented_pool = findCommentedPool(descriptor->file()->name());
+      const DescriptorType* commented =
+          commented_pool == NULL ? NULL : findByName(commented_pool, descriptor);
+      if (commented != NULL) {
+        return commented->DebugStringWithOptions(debug_string_options);
+      }
+    }
+    return descriptor->DebugStringWithOptions(debug_string_options);
+  }
+
+  /**
+   * Build type_index if it has not been built yet. It takes long enough that
+   * it is only built for the generations that are searched by type, and by
+   * the loading threads right after publishing a complete generation, so
+   * that it is usually ready by the time it is needed. Thread-safe.
+   */
+  void indexTypes() {
+    std::call_once(types_indexed, [this] {
+      type_index.build(database.getFiles(), catalog);
+    });
+  }
+
+  /**
+   * Whether token restricts a search to the methods that reach a field or
+   * type, rather than matching method names.
+   */
+  static bool isFilter(const std::string& token) {
+    return token.compare(0, 6, "field:") == 0 || token.compare(0, 5, "type:") == 0 ||
+        token.compare(0, 5, "uses:") == 0;
+  }
+
+  /**
+   * Search like MethodCatalog::search(), except that filter tokens such as
+   * field:idempotency_key keep only the methods whose request or response
+   * contains a field, message or enum with a name starting with the rest of
+   * the token, or for uses:, the message or enum with that full name. The
+   * other tokens then rank the methods that are kept. If cancelled returns
+   * true, the search stops early.
+   */
+  std::vector<const MethodEntry*> search(const std::vector<std::string>& tokens,
+      size_t* match_count,
+      const MethodCatalog::CancelCheck& cancelled = MethodCatalog::CancelCheck()) {
+    std::vector<std::string> name_tokens;
+    std::vector<const MethodEntry*> candidates;
+    bool filtered = false;
+    for (const std::string& token : tokens) {
+      if (!isFilter(token)) {
+        name_tokens.push_back(token);
+        continue;
+      }
+      size_t colon = token.find(':');
+      std::string name = token.substr(colon + 1);
+      indexTypes();
+      std::vector<const MethodEntry*> matches;
+      if (token[0] == 'f') {
+        matches = type_index.findByField(name);
+      } else if (token[0] == 't') {
+        matches = type_index.findByType(name);
+      } else {
+        matches = type_index.findUsers(name);
+      }
+      if (filtered) {
+        std::vector<const MethodEntry*> intersection;
+        std::set_intersection(candidates.begin(), candidates.end(),
+            matches.begin(), matches.end(), std::back_inserter(intersection));
+        matches.swap(intersection);
+      }
+      candidates.swap(matches);
+      filtered = true;
+    }
+    if (!filtered) {
+      return catalog.search(name_tokens, match_count, cancelled);
+    }
+    return MethodCatalog::rank(candidates, name_tokens, match_count, cancelled);
+  }
+
+  SharedFileDatabase database;
+  BuildErrorCollector error_collector;
+  DescriptorPool pool;
+
+  /**
+   * Creates messages for the descriptors in pool. Prototypes are cached by
+   * descriptor, so a factory must not outlive its pool.
+   */
+  DynamicMessageFactory message_factory;
+
+  MethodCatalog catalog;
+
+private:
+  /**
+   * A single file with source info, built on top of the files it imports.
+   */
+  struct CommentedFile {
+    CommentedFile(const FileMap& files)
+        : database(files)
+        , pool(&database, &error_collector) {}
+
+    SharedFileDatabase database;
+    BuildErrorCollector error_collector;
+    DescriptorPool pool;
+  };
+
+  /**
+   * The pool holding filename with its comments, or NULL if the file can no
+   * longer be parsed or built.
+   */
+  const DescriptorPool* findCommentedPool(const std::string& filename) {
+    auto cached = commented_files.find(filename);
+    if (cached != commented_files.end()) {
+      return cached->second ? &cached->second->pool : NULL;
+    }
+    std::unique_ptr<CommentedFile>& commented_file = commented_files[filename];
+
+    std::shared_ptr<const FileDescriptorProto> file =
+        parseWithSourceInfo(options.protoPaths, filename);
+    if (file == NULL) {
+      return NULL;
+    }
+    // Only the imports of the file are needed to build it.
+    const FileMap& all_files = database.getFiles();
+    FileMap files;
+    std::vector<std::string> pending(file->dependency().begin(), file->dependency().end());
+    while (!pending.empty()) {
+      std::string dependency = pending.back();
+      pending.pop_back();
+      auto it = all_files.find(dependency);
+      if (it == all_files.end() || !files.insert(*it).second) {
+        continue;
+      }
+      pending.insert(pending.end(),
+          it->second->dependency().begin(), it->second->dependency().end());
+    }
+    files[filename] = file;
+
+    commented_file.reset(new CommentedFile(files));
+    if (commented_file->pool.FindFileByName(filename) == NULL) {
+      commented_file.reset();
+      return NULL;
+    }
+    return &commented_file->pool;
+  }
+
+  static const Descriptor* findByName(const DescriptorPool* pool,
+      const Descriptor* descriptor) {
+    return pool->FindMessageTypeByName(descriptor->full_name());
+  }
+
+  static const EnumDescriptor* findByName(const DescriptorPool* pool,
+      const EnumDescriptor* descriptor) {
+    return pool->FindEnumTypeByName(descriptor->full_name());
+  }
+
+  static const MethodDescriptor* findByName(const DescriptorPool* pool,
+      const MethodDescriptor* descriptor) {
+    return pool->FindMethodByName(descriptor->full_name());
+  }
+
+  const Options& options;
+
+  TypeIndex type_index;
+  std::once_flag types_indexed;
+
+  /**
+   * Files parsed again for their comments, by name. NULL if that failed.
+   */
+  std::map<std::string, std::unique_ptr<CommentedFile>> commented_files;
+};
+
+/**
+ * A hash that is stable across builds, unlike std::hash.
+ */
+static uint64_t fnv1a(const std::string& input) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : input) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * A file name for state kept per set of proto paths. It is keyed on the
+ * absolute proto paths, so that running from a different directory with the
+ * same roots shares the state.
+ */
+static std::string protoPathsKey(const std::vector<const char*>& proto_paths) {
+  std::string roots;
+  for (const char* proto_path : proto_paths) {
+    roots += std::filesystem::absolute(proto_path).lexically_normal().string();
+    roots += '\n';
+  }
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long) fnv1a(roots));
+  return key;
+}
+
+/**
+ * The proto files that methods were used from in past runs, with how often
+ * and when each was last used, stored as a small text file per set of proto
+ * paths. Loading the frequently used files first makes the usual methods
+ * searchable long before the rest of the proto paths have been loaded.
+ */
+class UsageProfile {
+public:
+  UsageProfile(const std::string& state_dir,
+      const std::vector<const char*>& proto_paths)
+      : profile_path(state_dir + "/" + protoPathsKey(proto_paths) + ".usage") {}
+
+  /**
+   * Read the profile if it exists. A missing or corrupt profile is treated as
+   * empty.
+   */
+  void load() {
+    usages.clear();
+    std::ifstream input(profile_path);
+    std::string line;
+    if (!std::getline(input, line) || line != header()) {
+      return;
+    }
+    while (std::getline(input, line)) {
+      // count \t last_used \t name
+      size_t count_end = line.find('\t');
+      size_t last_used_end = line.find('\t', count_end + 1);
+      if (count_end == std::string::npos || last_used_end == std::string::npos) {
+        usages.clear();
+        return;
+      }
+      Usage& usage = usages[line.substr(last_used_end + 1)];
+      usage.count = atoll(line.substr(0, count_end).c_str());
+      usage.last_used = atoll(line.substr(count_end + 1, last_used_end - count_end - 1).c_str());
+    }
+  }
+
+  /**
+   * The most used files, favoring recent use, at most limit of them.
+   */
+  std::vector<std::string> getFrequentFiles(int limit) const {
+    int64_t now = time(NULL);
+    std::vector<std::pair<double, std::string>> ranked;
+    for (const auto& name_and_usage : usages) {
+      const Usage& usage = name_and_usage.second;
+      double days_unused = std::max<int64_t>(0, now - usage.last_used) / 86400.0;
+      ranked.emplace_back(usage.count / (1 + days_unused / 30), name_and_usage.first);
+    }
+    std::sort(ranked.begin(), ranked.end(),
+        [](const std::pair<double, std::string>& a, const std::pair<double, std::string>& b) {
+          return a.first > b.first;
+        });
+    std::vector<std::string> filenames;
+    for (int i = 0; i < ranked.size() && i < limit; i++) {
+      filenames.push_back(ranked[i].second);
+    }
+    return filenames;
+  }
+
+  /**
+   * Count a use of a method from filename. Only the profile in memory changes
+   * until save().
+   */
+  void recordUse(const std::string& filename) {
+    int64_t now = time(NULL);
+    for (Usage* usage : {&usages[filename], &recorded[filename]}) {
+      usage->count++;
+      usage->last_used = now;
+    }
+  }
+
+  /**
+   * Write the uses recorded in this run, if any, to the profile. The profile
+   * is read again first, so that concurrent runs do not lose each other's
+   * uses.
+   */
+  void save() {
+    if (recorded.empty()) {
+      return;
+    }
+    load();
+    for (const auto& name_and_usage : recorded) {
+      Usage& usage = usages[name_and_usage.first];
+      usage.count += name_and_usage.second.count;
+      usage.last_used = std::max(usage.last_used, name_and_usage.second.last_used);
+    }
+    recorded.clear();
+    write();
+  }
+
+private:
+  struct Usage {
+    int64_t count = 0;
+
+    /**
+     * Seconds since the epoch.
+     */
+    int64_t last_used = 0;
+  };
+
+  /**
+   * Files that have not been used for this long are forgotten.
+   */
+  static const int64_t kForgetAfterSeconds = 180 * 86400;
+
+  static std::string header() {
+    return "RpcExplorer usage 1";
+  }
+
+  /**
+   * Write to a temporary file and rename it into place, so that concurrent
+   * runs never observe a partially written profile.
+   */
+  void write() {
+    int64_t now = time(NULL);
+    std::string contents = header() + "\n";
+    for (const auto& name_and_usage : usages) {
+      const Usage& usage = name_and_usage.second;
+      if (now - usage.last_used < kForgetAfterSeconds) {
+        contents += std::to_string(usage.count) + "\t" +
+            std::to_string(usage.last_used) + "\t" + name_and_usage.first + "\n";
+      }
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(
+        std::filesystem::path(profile_path).parent_path(), ec);
+    std::string temp_path = profile_path + "." + std::to_string(getpid());
+    {
+      std::ofstream output(temp_path, std::ios::trunc);
+      output << contents;
+      if (!output) {
+        output.close();
+        std::filesystem::remove(temp_path, ec);
+        return;
+      }
+    }
+    std::filesystem::rename(temp_path, profile_path, ec);
+  }
+
+  std::string profile_path;
+  std::map<std::string, Usage> usages;
+
+  /**
+   * The uses recorded since the last save().
+   */
+  std::map<std::string, Usage> recorded;
+};
+
+/**
+ * Subclasses represent a full page cureses display and handle all rendering
+ * and interactions with the user.
+ */
+class UserFacingPage {
+public:
+  /**
+   * Consume a key from the user. This will be invoked after global hotkeys are
+   * examined and do not consume the key.
+   *
+   * Returning True means completed, so the caller should pop this screen off
+   * of the stack and destroy it.
+   */
+  virtual bool handleInput(int keyCode, int functionKey) = 0;
+  virtual void redraw() = 0;
+  virtual ~UserFacingPage() {}
+
+  /**
+   * Get the active object, needed for getting user input.
+   */
+  virtual CDKOBJS* getCDKActiveObject() = 0;
+
+  /**
+   * How long to wait for input, in milliseconds, before calling onIdle(), or
+   * -1 to wait until there is input.
+   */
+  virtual int getIdleTimeout() {
+    return -1;
+  }
+
+  /**
+   * Called when no input arrived within the idle timeout, to do work that is
+   * not worth doing while keys are still arriving.
+   */
+  virtual void onIdle() {}
+};
+
+/**
+ * A page where users can build requests interactively, make requests, and
+ * export scripts.
+ */
+class RequestBuilderPage : public UserFacingPage {
+public:
+  /**
+   * Constructor. Will crash program on failures. The page keeps generation
+   * alive, so that method_descriptor stays valid while protos are reloaded.
+   */
+  RequestBuilderPage(const MethodDescriptor* method_descriptor,
+      std::shared_ptr<ProtoGeneration> generation,
+      const Options& options)
       : method_descriptor(method_descriptor)
       , input_descriptor(method_descriptor->input_type())
-      , options(options) {
+      , generation(generation)
+      , request_arena(&generation->message_factory)
+      , options(options)
+      , method_variables(getMethodVariables(method_descriptor, options.protoPaths)) {
     proto_files_of_used_methods.insert(method_descriptor->file()->name());
+    if (usage_profile != NULL) {
+      usage_profile->recordUse(method_descriptor->file()->name());
+    }
+    cdk_screen = initCDKScreen (NULL);
+    // Initially, the virtual and physical screen sizes are the same.
+    min_row_to_display = 0;
+    max_row_to_display = num_rows - ROWS_FOR_ONSCREEN_HELP;
+    // Create the initial set of entries based on the top level field of the
+    // descriptor.
+    for (int i = 0; i < input_descriptor->field_count(); i++) {
+      const FieldDescriptor* field_descriptor = input_descriptor->field(i);
+      addDescriptorToDisplay(field_descriptor, ProtoCDKFieldTree::REQUEST, 0, i);
+    }
+
+    // Add the buttons to the list. Their CDK objects are created when they
+    // are on screen, like those of the fields.
+    int button = field_tree.add(-1);
+    field_tree[button].field_cdk_type = REQUEST_BUTTON;
+    rows.insert(rows.size(), button);
+
+    button = field_tree.add(-1);
+    field_tree[button].field_cdk_type = EXPORT_BUTTON;
+    rows.insert(rows.size(), button);
+
+    index = 0;
+    renderVisibleFields();
+    createHelpWindow();
+
+    // Create the display on the right and initialize with empty JSON
+    json_display = newCDKSwindow(cdk_screen, RIGHT, TOP, num_rows - ROWS_FOR_ONSCREEN_HELP, num_cols / 2, "", 1000, 1, 0);
+    drawCDKSwindow(json_display, 1);
+    json_pane.setWindow(json_display);
+    updateJsonDisplay();
+
+    // Set up the current focus
+    cur_object = setCDKFocusCurrent(cdk_screen, fieldAt(index).field_cdk_obj);
+    setFocus(cur_object);
+  }
+
+  /**
+   * Destructor.
+   */
+  ~RequestBuilderPage() {
+    destroyFieldObjects();
+
+    destroyCDKSwindow(json_display);
+    json_display = NULL;
+
+    if (help_window != NULL) {
+      destroyCDKSwindow(help_window);
+      help_window = NULL;
+    }
+
+    destroyCDKScreen(cdk_screen);
+    cdk_screen = NULL;
+  }
+
+  virtual bool handleInput(int key_code, int function_key) {
+    int field = rows[index];
+    ProtoCDKField* proto_cdk_field = &field_tree[field];
+    switch (key_code){
+      case KEY_BTAB:
+      case KEY_UP:
+        focusPrevious();
+        break;
+      case KEY_TAB:
+      case KEY_DOWN:
+        focusNext();
+        break;
+      case 153: // Alt-H
+      case KEY_F1:
+        if (proto_cdk_field->field_cdk_type != ENTRY &&
+            proto_cdk_field->field_cdk_type != EXPAND_BUTTON &&
+            proto_cdk_field->field_cdk_type != ADD_BUTTON) {
+          break;
+        }
+        // Show the definition for the current field if it's an enum or message
+        if (proto_cdk_field->field_descriptor->type() == FieldDescriptor::Type::TYPE_ENUM) {
+          std::string debugString = generation->describe(proto_cdk_field->field_descriptor->enum_type());
+          showInfoPanel(cdk_screen, debugString);
+        } else if (proto_cdk_field->field_descriptor->type() == FieldDescriptor::Type::TYPE_MESSAGE) {
+          std::string debugString = generation->describe(proto_cdk_field->field_descriptor->message_type());
+          showInfoPanel(cdk_screen, debugString);
+        } else {
+          // Show the definition of the enclosing message
+          std::string debugString = generation->describe(proto_cdk_field->field_descriptor->containing_type());
+          showInfoPanel(cdk_screen, debugString);
+        }
+        break;
+      case KEY_ENTER:
+        // Check if we are a button.
+        if (proto_cdk_field->field_cdk_type == EXPAND_BUTTON) {
+          // Hide the button
+          proto_cdk_field->hide_expand = 1;
+          const Descriptor* input_descriptor = proto_cdk_field->field_descriptor->message_type();
+          int tab_index = proto_cdk_field->tab_index + 1;
+          debugMsg(DEBUG_UI, DEBUG_TRACE, "Added children to field %s\n",
+              input_descriptor->full_name().c_str());
+          // Adding fields moves them, so proto_cdk_field is not used below.
+          for (int i = 0; i < input_descriptor->field_count(); i++) {
+            const FieldDescriptor* field_descriptor = input_descriptor->field(i);
+            debugMsg(DEBUG_UI, DEBUG_TRACE, "Adding child %s\n",
+                field_descriptor->full_name().c_str());
+            addDescriptorToDisplay(field_descriptor, field, tab_index, index + 1 + i);
+          }
+          markJsonDirty(field);
+          debugMsg(DEBUG_UI, DEBUG_TRACE, "Added %d children to field.\n",
+              input_descriptor->field_count());
+          // This destroys the Expand button, since it is now hidden.
+          renderVisibleFields();
+          focusNext();
+          setFocus(cur_object);
+        } else if (proto_cdk_field->field_cdk_type == ADD_BUTTON) {
+          // Add a copy of the repeated field
+          addDescriptorToDisplay(
+              proto_cdk_field->field_descriptor, field,
+              proto_cdk_field->tab_index + 1, index + 1, /*child_of_repeated*/1);
+          markJsonDirty(field);
+          renderVisibleFields();
+          focusNext();
+        } else if (proto_cdk_field->field_cdk_type == REQUEST_BUTTON) {
+          std::string path =
+              exportScript(options.request_template, cdk_screen, &request_arena, method_descriptor, field_tree, method_variables);
+          if (path.empty()) {
+            break;
+          }
+
+          char cmd_buffer[1024];
+          // Update permissions
+          snprintf(cmd_buffer, sizeof(cmd_buffer), "chmod u+x '%s'", path.c_str());
+          system(cmd_buffer);
+          // Execute script
+          // Redirect stdin to prevent subprocesses from accessing our tty and
+          // setting the foreground process group ID.
+          // When subprocesses do this, RpcExplorer can appear to become
+          // unresponsive because they steal input and signals from
+          // RpcExplorer.
+          snprintf(cmd_buffer, sizeof(cmd_buffer), "'%s' 2>&1 < /dev/null", path.c_str());
+          debugMsg(DEBUG_SCRIPT, DEBUG_INFO, "Start executing generated script %s.\n", cmd_buffer);
+          std::string cmd_output = exec_cmd(cmd_buffer);
+          debugMsg(DEBUG_SCRIPT, DEBUG_INFO, "Finished executing script.\n");
+          debugMsg(DEBUG_SCRIPT, DEBUG_INFO, "Script output:\n'''\n%s\n'''\n", cmd_output.c_str());
+          // Clean up script
+          snprintf(cmd_buffer, sizeof(cmd_buffer), "rm -f '%s'", path.c_str());
+          system(cmd_buffer);
+          showInfoPanel(cdk_screen, cmd_output);
+          debugMsg(DEBUG_SCRIPT, DEBUG_TRACE, "Finished showing command output.");
+        } else if (proto_cdk_field->field_cdk_type == EXPORT_BUTTON) {
+          std::string path =
+              exportScript(options.request_template, cdk_screen, &request_arena, method_descriptor, field_tree, method_variables, 1);
+
+          // Path contained a single quote.
+          // This check is not needed above because we did not try to export to
+          // a filename that the user provided.
+          if (path.empty()) {
+            showInfoPanel(cdk_screen, "Filenames cannot contain single quote characters.");
+            break;
+          }
+
+          char cmd_buffer[1024];
+          // Update permissions
+          snprintf(cmd_buffer, sizeof(cmd_buffer), "chmod u+x '%s'", path.c_str());
+          system(cmd_buffer);
+
+          char cmd_output[1024];
+          snprintf(cmd_output, sizeof(cmd_output), "Wrote script file to '%s'!", path.c_str());
+          showInfoPanel(cdk_screen, cmd_output);
+        }
+        break;
+      case CDK_REFRESH:
+        /* redraw screen */
+        redraw();
+        break;
+      case KEY_ESC:
+      case KEY_F7:
+        return true;
+      default:
+        InjectObj(cur_object, key_code);
+        // Keep the contents of the entry in the field. Only keys that change
+        // them change the preview.
+        if (proto_cdk_field->field_cdk_type == ENTRY) {
+          const char* value = ((CDKENTRY*)proto_cdk_field->field_cdk_obj)->info;
+          if (proto_cdk_field->field_value != (value == NULL ? "" : value)) {
+            proto_cdk_field->field_value = value == NULL ? "" : value;
+            markJsonDirty(field);
+          }
+        }
+    }
+    debugMsg(DEBUG_UI, DEBUG_TRACE, "index = %d\n", index);
+    setFocus(cur_object);
+    return false;
+  }
+
+  virtual void redraw() {
+    // This is needed in case the window is resized.
+    max_row_to_display = min_row_to_display + (num_rows - ROWS_FOR_ONSCREEN_HELP);
+    // Ensure that we scroll the window down enough to see the currently
+    // selected object.
+    scrollToField(index);
+
+    // Destroy help first so that the destruction of help does not erase the
+    // fields that were in its former location.
+    if (help_window != NULL) {
+      destroyCDKSwindow(help_window);
+    }
+
+    // Recreate the JSON display to handle resizing events.
+    if (json_display != NULL) {
+      destroyCDKSwindow(json_display);
+      json_display = NULL;
+    }
+
+    renderVisibleFields();
+    json_display = newCDKSwindow(cdk_screen, RIGHT, TOP, num_rows - ROWS_FOR_ONSCREEN_HELP,
+        num_cols / 2, "", 1000, 1, 0);
+    drawCDKSwindow(json_display, 1);
+    json_pane.setWindow(json_display);
+    updateJsonDisplay();
+
+    createHelpWindow();
+    cur_object = setCDKFocusCurrent(cdk_screen, fieldAt(index).field_cdk_obj);
+    if (cur_object) {
+      setFocus(cur_object);
+    }
+  };
+
+  virtual CDKOBJS* getCDKActiveObject() {
+    return cur_object;
+  }
+
+  /**
+   * The JSON preview waits until no edits have arrived for
+   * JSON_PREVIEW_DELAY_MS, so that a burst of typing rebuilds it once.
+   */
+  virtual int getIdleTimeout() {
+    if (!field_tree[ProtoCDKFieldTree::REQUEST].json_dirty) {
+      return -1;
+    }
+    auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+        json_refresh_due - std::chrono::steady_clock::now()).count();
+    return remaining > 0 ? (int)remaining : 0;
+  }
+
+  virtual void onIdle() {
+    if (field_tree[ProtoCDKFieldTree::REQUEST].json_dirty &&
+        std::chrono::steady_clock::now() >= json_refresh_due) {
+      updateJsonDisplay();
+      if (cur_object) {
+        setFocus(cur_object);
+      }
+    }
+  }
+private:
+  /**
+   * The screen used for drawing CDK objects.
+   */
+  CDKSCREEN* cdk_screen;
+
+  /**
+   * The window on the right used for displaying the JSON representation of the
+   * constructed proto.
+   */
+  CDKSWINDOW* json_display;
+
+  /**
+   * The fields of the message we are constructing, whose top-level fields are
+   * the children of ProtoCDKFieldTree::REQUEST, and the buttons.
+   */
+  ProtoCDKFieldTree field_tree;
+
+  /**
+   * The fields in field_tree in the order that they are displayed, including
+   * buttons.
+   */
+  FieldRows rows;
+
+  /**
+   * The fields in field_tree that have CDK objects, which are those in the
+   * rows between min_row_to_display and max_row_to_display.
+   */
+  std::vector<int> rendered_fields;
+
+  /**
+   * The labels of the fields, by descriptor, so that the fields with the same
+   * descriptor share one.
+   */
+  std::unordered_map<const FieldDescriptor*, std::string> field_labels;
+
+  /**
+   * Shows the JSON representation of the request in json_display, assembled
+   * from the JSON fragments of the top-level fields. It is out of date when
+   * the json_dirty of ProtoCDKFieldTree::REQUEST is set.
+   */
+  TextPane json_pane;
+
+  /**
+   * When the JSON preview should be refreshed, if the request has changed.
+   */
+  std::chrono::steady_clock::time_point json_refresh_due;
+
+  /**
+   * The row of the current object in rows.
+   */
+  int index;
+
+  /**
+   * The currently focused object, which will receive events.
+   */
+  CDKOBJS *cur_object;
+
+  /**
+   * The minimum row of the virtual display to render, for scrolling.
+   */
+  int min_row_to_display;
+
+  /**
+   * The maximum row of the virtual display to rende, for scrolling.
+   */
+  int max_row_to_display;
+
+  /**
+   * The window where help text will be drawn.
+   */
+  CDKSWINDOW* help_window;
+
+  /**
+   * The descriptor of the Rpc method we are constructing a request for.
+   */
+  const MethodDescriptor* method_descriptor;
+
+  /**
+   * The message descriptor of the input type of the method_descriptor.
+   */
+  const Descriptor* input_descriptor;
+
+  /**
+   * The generation that owns method_descriptor.
+   */
+  std::shared_ptr<ProtoGeneration> generation;
+
+  /**
+   * Where the request is built for the JSON display and for scripts.
+   */
+  RequestArena request_arena;
+
+  /**
+   * The command line options passed into the program.
+   */
+  const Options& options;
+
+  /**
+   * The values of the request template variables that depend only on the
+   * method.
+   */
+  std::unordered_map<std::string, std::string> method_variables;
+
+  /**
+   * Add the given field descriptor as the last child of parent, and insert
+   * it at the given row of the display. Returns the index of the new field
+   * in field_tree.
+   */
+  int addDescriptorToDisplay(
+      const FieldDescriptor* field_descriptor,
+      int parent,
+      int tab_index,
+      int insert_before,
+      int child_of_repeated = 0) {
+    FieldDescriptor::Type field_type = field_descriptor->type();
+    int field = field_tree.add(parent);
+    ProtoCDKField* proto_cdk_field = &field_tree[field];
+    proto_cdk_field->field_descriptor = field_descriptor;
+    proto_cdk_field->field_label_string = getFieldLabel(field_descriptor);
+
+    if (field_descriptor->is_repeated() && !child_of_repeated) {
+      proto_cdk_field->field_cdk_type = ADD_BUTTON;
+    } else {
+      if (field_type != FieldDescriptor::Type::TYPE_MESSAGE) {
+        proto_cdk_field->field_cdk_type = ENTRY;
+      } else {
+        proto_cdk_field->field_cdk_type = EXPAND_BUTTON;
+      }
+    }
+
+    proto_cdk_field->tab_index = tab_index;
+    rows.insert(insert_before, field);
+    return field;
+  }
+
+  /**
+   * The label for fields with the given descriptor, which is made once and
+   * then shared.
+   */
+  const char* getFieldLabel(const FieldDescriptor* field_descriptor) {
+    std::string& label = field_labels[field_descriptor];
+    if (!label.empty()) {
+      return label.c_str();
+    }
+    const std::string& field_name = field_descriptor->name();
+    FieldDescriptor::Type field_type = field_descriptor->type();
+    if (field_type == FieldDescriptor::Type::TYPE_ENUM) {
+      label = field_descriptor->enum_type()->full_name() + " " + field_name + ":";
+      if (label.size() > num_cols / 2 - 6) {
+        label = field_descriptor->enum_type()->name() + " " + field_name + ":";
+      }
+    } else if (field_type == FieldDescriptor::Type::TYPE_MESSAGE) {
+      label = field_descriptor->message_type()->full_name() + " " + field_name + ":";
+      // Label is too long, truncate it.
+      if (label.size() > num_cols / 2 - 6) {
+        label = field_descriptor->message_type()->name() + " " + field_name + ":";
+      }
+    } else {
+      label = std::string(field_descriptor->type_name()) + " " + field_name + ":";
+    }
+    return label.c_str();
+  }
+
+  /**
+   * The field displayed on the given row.
+   */
+  ProtoCDKField& fieldAt(int row) {
+    return field_tree[rows[row]];
+  }
+
+  /**
+   * The row of the virtual screen that the field in the given row of rows is
+   * rendered on. The buttons at the end share a row.
+   */
+  int virtualRow(int row) {
+    int button_row = rows.size() - 2;
+    return row < button_row ? row : rows.size();
+  }
+
+  /**
+   * Move the rows that are displayed just far enough to show the field in
+   * the given row of rows. Returns true if they moved.
+   */
+  bool scrollToField(int row) {
+    int virtual_row = virtualRow(row);
+    int shift = 0;
+    if (virtual_row > max_row_to_display) {
+      shift = virtual_row - max_row_to_display;
+    } else if (virtual_row < min_row_to_display) {
+      shift = virtual_row - min_row_to_display;
+    }
+    min_row_to_display += shift;
+    max_row_to_display += shift;
+    return shift != 0;
+  }
+
+  /**
+   * Destroy the CDK objects of the fields that are on screen.
+   */
+  void destroyFieldObjects() {
+    // Erase before creating, to avoid erasing after creating.
+    for (int field : rendered_fields) {
+      ProtoCDKField* proto_cdk_field = &field_tree[field];
+      if (proto_cdk_field->field_cdk_label != NULL) {
+        destroyCDKObject((CDKLABEL*)proto_cdk_field->field_cdk_label);
+        proto_cdk_field->field_cdk_label = NULL;
+      }
+      if (proto_cdk_field->field_cdk_obj != NULL) {
+        if (proto_cdk_field->field_cdk_type == ENTRY) {
+          destroyCDKObject((CDKENTRY*)proto_cdk_field->field_cdk_obj);
+        } else {
+          destroyCDKObject((CDKBUTTON*)proto_cdk_field->field_cdk_obj);
+        }
+        proto_cdk_field->field_cdk_obj = NULL;
+      }
+    }
+    rendered_fields.clear();
+  }
+
+  /**
+   * Destroy the CDK objects of the fields that are on screen, and create them
+   * for the fields in the rows between min_row_to_display and
+   * max_row_to_display. Fields that are off screen have no CDK objects, so
+   * the cost depends on the size of the screen rather than on the number of
+   * fields. cur_object is updated to the object of the current field.
+   */
+  void renderVisibleFields() {
+    // Erase before creating, to avoid erasing after creating.
+    destroyFieldObjects();
+
+    // Create and draw, since moving is not working in CDK
+    int button_row = rows.size() - 2;
+    int end = std::min(max_row_to_display + 1, button_row);
+    for (int i = std::max(min_row_to_display, 0); i < end; i++) {
+      createFieldObjects(i);
+    }
+    int button_virtual_row = virtualRow(button_row);
+    if (button_virtual_row >= min_row_to_display && button_virtual_row <= max_row_to_display) {
+      createFieldObjects(button_row);
+      createFieldObjects(button_row + 1);
+    }
+    cur_object = fieldAt(index).field_cdk_obj;
+  }
+
+  /**
+   * Create and draw the CDK objects for the field in the given row of rows,
+   * which must be on screen.
+   */
+  void createFieldObjects(int row) {
+    ProtoCDKField* proto_cdk_field = &fieldAt(row);
+    int ypos = virtualRow(row) - min_row_to_display;
+    rendered_fields.push_back(rows[row]);
+
+    // Handle the special buttons without labels first
+    if (proto_cdk_field->field_cdk_type == REQUEST_BUTTON) {
+      CDKBUTTON* request_button = newCDKButton(cdk_screen, LEFT, ypos,
+          "Make Request",[](struct SButton *button){}, 0, 0);
+      proto_cdk_field->field_cdk_obj = (CDKOBJS*) request_button;
+      drawCDKButton(request_button, 0);
+      unsetFocus(proto_cdk_field->field_cdk_obj);
+      return;
+    } else if (proto_cdk_field->field_cdk_type == EXPORT_BUTTON) {
+      CDKBUTTON* export_button = newCDKButton(cdk_screen, strlen("Make Request") + 2, ypos,
+          "Export Script",[](struct SButton *button){}, 0, 0);
+      proto_cdk_field->field_cdk_obj = (CDKOBJS*) export_button;
+      drawCDKButton(export_button, 0);
+      unsetFocus(proto_cdk_field->field_cdk_obj);
+      return;
+    }
+
+    int xpos = 2 * proto_cdk_field->tab_index;
+    proto_cdk_field->field_cdk_label =
+        newCDKLabel(cdk_screen, xpos, ypos, &proto_cdk_field->field_label_string, 1, 0, 0);
+    drawCDKLabel(proto_cdk_field->field_cdk_label, 0);
+    xpos += strlen(proto_cdk_field->field_label_string) + 1;
+    int width = num_cols / 2 - xpos - 1;
+    if (proto_cdk_field->field_cdk_type == ENTRY) {
+      CDKENTRY* entry = newCDKEntry (cdk_screen,
+          xpos, ypos,
+          /*title=*/"", /*label=*/"", A_NORMAL, '_', vMIXED,
+          width, 0, 256,
+          FALSE, FALSE);
+      if (!proto_cdk_field->field_value.empty()) {
+        setCDKEntryValue(entry, proto_cdk_field->field_value.c_str());
+      }
+      drawCDKEntry(entry, 1);
+      proto_cdk_field->field_cdk_obj = (CDKOBJS*) entry;
+    } else if (proto_cdk_field->field_cdk_type == EXPAND_BUTTON) {
+      if (!proto_cdk_field->hide_expand) {
+        CDKBUTTON* button = newCDKButton(cdk_screen, xpos, ypos, "Expand",[](struct SButton *button){}, 0, 0);
+        drawCDKButton(button, 0);
+        proto_cdk_field->field_cdk_obj = (CDKOBJS*) button;
+      }
+    } else if (proto_cdk_field->field_cdk_type == ADD_BUTTON) {
+      CDKBUTTON* button = newCDKButton(cdk_screen, xpos, ypos, "Add",[](struct SButton *button){}, 0, 0);
+      drawCDKButton(button, 0);
+      proto_cdk_field->field_cdk_obj = (CDKOBJS*) button;
+    }
+    if (proto_cdk_field->field_cdk_obj) {
+      unsetFocus(proto_cdk_field->field_cdk_obj);
+    }
+  }
+
+  /**
+   * Mark a field and its ancestors as changed, so that their JSON fragments
+   * are rendered again on the next update of the JSON display, and put off
+   * that update until the edits stop.
+   */
+  void markJsonDirty(int field) {
+    json_refresh_due = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(JSON_PREVIEW_DELAY_MS);
+    for (; field != -1; field = field_tree[field].parent) {
+      field_tree[field].json_dirty = true;
+    }
+  }
+
+  /**
+   * Parse the proto values that changed and redraw the lines of the JSON
+   * display on the right that changed.
+   */
+  void updateJsonDisplay() {
+    ProtoCDKField& request = field_tree[ProtoCDKFieldTree::REQUEST];
+    if (request.json_dirty) {
+      json_pane.setText(composeJsonObject(&request_arena, field_tree,
+          ProtoCDKFieldTree::REQUEST, 0) + "\n");
+      request.json_dirty = false;
+    }
+  }
+
+  /**
+   * Change the focus to the previous item in rows.
+   */
+  void focusPrevious() {
+    if (cur_object) {
+      unsetFocus(cur_object);
+    }
+    if (index == 0) {
+      index = rows.size() - 1;
+    } else {
+      index--;
+      index %= rows.size();
+    }
+    // Scrolling only recreates the objects of the rows on screen.
+    if (scrollToField(index)) {
+      renderVisibleFields();
+    }
+
+    if (fieldAt(index).hide_expand) {
+      focusPrevious();
+    } else {
+      cur_object = setCDKFocusCurrent(cdk_screen, fieldAt(index).field_cdk_obj);
+      setFocus(cur_object);
+    }
+  }
+
+  /**
+   * Change the focus to the next item in rows.
+   */
+  void focusNext() {
+    debugMsg(DEBUG_UI, DEBUG_TRACE, "focusNext: cur_object = %p\n", cur_object);
+    // If there was a scrolling event and the currently focused object is an
+    // already-expanded EXPAND button (which can happen on a recursive call
+    // after a scrolling event), then cur_object will be NULL.
+    if (cur_object) {
+      unsetFocus(cur_object);
+    }
+
+    debugMsg(DEBUG_UI, DEBUG_TRACE, "focusNext: indexBefore = %d\n", index);
+    index++;
+    index %= rows.size();
+    debugMsg(DEBUG_UI, DEBUG_TRACE, "focusNext: indexAfter = %d\n", index);
+
+    // Scrolling only recreates the objects of the rows on screen.
+    bool scrolled = scrollToField(index);
+    debugMsg(DEBUG_UI, DEBUG_TRACE, "focusNext: virtual row = %d\n", virtualRow(index));
+    debugMsg(DEBUG_UI, DEBUG_TRACE, "focusNext: max_row_to_display = %d\n", max_row_to_display);
+    debugMsg(DEBUG_UI, DEBUG_TRACE, "focusNext: min_row_to_display = %d\n", min_row_to_display);
+    if (scrolled) {
+      renderVisibleFields();
+      debugMsg(DEBUG_UI, DEBUG_TRACE, "focusNext: Finished rendering\n");
+    }
+
+    if (fieldAt(index).hide_expand) {
+      debugMsg(DEBUG_UI, DEBUG_TRACE, "focusNext: recursing\n");
+      focusNext();
+    } else {
+      cur_object = setCDKFocusCurrent(cdk_screen, fieldAt(index).field_cdk_obj);
+      setFocus(cur_object);
+    }
+  }
+
+  /**
+   * Helper function for creating the help section of this page.
+   */
+  void createHelpWindow() {
+    help_window = newCDKSwindow(cdk_screen, LEFT, num_rows - 5, 4, num_cols, "USAGE", 5, 0, 0);
+    if (help_window == 0) {
+      debugMsg(DEBUG_UI, DEBUG_ERROR, "Failed to create help window. Perhaps screen was too small.\n");
+      return;
+    }
+    std::string help_text =
+      "TAB/SHIFT-TAB Move cursor  \tENTER Execute action"
+      "\nF1 View proto definition \tESC Back"
+      "\nF7 Return to search";
+    showMultilineMessage(help_window, help_text);
+    drawCDKSwindow(help_window, 0);
+  }
+
+};
+/**
+ * A page where users can search for and select Rpcs.
+ */
+class RpcSearchPage : public UserFacingPage {
+public:
+  /**
+   * Constructor.
+   *
+   * Note that the program cannot continue if this constructor fails, it will
+   * simply crash the program rather than throwing an exception in the case of
+   * failure.
+   */
+  RpcSearchPage(
+      std::vector<UserFacingPage*>& page_stack,
+      std::shared_ptr<ProtoGeneration> generation,
+      const Options& options) :
+    page_stack(page_stack),
+    generation(generation),
+    options(options) {
+
+
     cdk_screen = initCDKScreen (NULL);
-    // Initially, the virtual and physical screen sizes are the same.
-    min_row_to_display = 0;
-    max_row_to_display = num_rows - ROWS_FOR_ONSCREEN_HELP;
-    // Create the initial set of entries based on the top level field of the
-    // descriptor.
-    for (int i = 0; i < input_descriptor->field_count(); i++) {
-      const FieldDescriptor* field_descriptor = input_descriptor->field(i);
-      root_proto_cdk_fields.push_back(addDescriptorToDisplay(field_descriptor, 0, i));
-    }
-    CDKBUTTON* request_button =
-        newCDKButton(cdk_screen, LEFT, proto_cdk_fields.size() + 2, "Make Request",[](struct SButton *button){}, 0, 0);
-    CDKBUTTON* export_button =
-        newCDKButton(cdk_screen, strlen("Make Request") + 2, proto_cdk_fields.size() + 2, "Export Script",[](struct SButton *button){}, 0, 0);
-
-    // Add the buttons to the list
-    ProtoCDKField* proto_cdk_field = new ProtoCDKField();
-    proto_cdk_field->field_cdk_obj = (CDKOBJS*) request_button;
-    proto_cdk_field->field_cdk_type = REQUEST_BUTTON;
-    proto_cdk_field->tab_index = 0;
-    unsetFocus(proto_cdk_field->field_cdk_obj);
-    proto_cdk_fields.push_back(proto_cdk_field);
-
-    proto_cdk_field = new ProtoCDKField();
-    proto_cdk_field->field_cdk_obj = (CDKOBJS*) export_button;
-    proto_cdk_field->field_cdk_type = EXPORT_BUTTON;
-    proto_cdk_field->tab_index = 0;
-    unsetFocus(proto_cdk_field->field_cdk_obj);
-    proto_cdk_fields.push_back(proto_cdk_field);
-
-    redrawProtoCdkFields(0);
+    initCDKColor ();
+
+    createHelpWindow();
+    createSearchEntryOrDie();
+    selection = NULL;
+    first_row = 0;
+    visible_rows = 0;
+    match_count = 0;
+    search_pending = false;
+  }
+
+  /**
+   * Destructor.
+   */
+  ~RpcSearchPage() {
+    destroyCDKEntry(search_term_entry);
+    search_term_entry = NULL;
+
+    if (selection != NULL) {
+      destroyCDKSelection(selection);
+      selection = NULL;
+    }
+    if (help_window != NULL ) {
+      destroyCDKSwindow(help_window);
+    }
+    destroyCDKScreen (cdk_screen);
+  }
+
+  virtual bool handleInput(int key_code, int function_key) {
+    // The selection only holds the rows on screen, so moving through the
+    // results is done here rather than by the selection.
+    if (cur_object == (CDKOBJS*) selection) {
+      switch (key_code) {
+        case 'j':
+        case KEY_DOWN:
+          selectRow(getSelectedRow() + 1);
+          return false;
+        case 'k':
+        case KEY_UP:
+          selectRow(getSelectedRow() - 1);
+          return false;
+        case KEY_NPAGE:
+          selectRow(getSelectedRow() + visible_rows);
+          return false;
+        case KEY_PPAGE:
+          selectRow(getSelectedRow() - visible_rows);
+          return false;
+        case KEY_HOME:
+          selectRow(0);
+          return false;
+        case KEY_END:
+          selectRow(found_methods.size() - 1);
+          return false;
+      }
+    }
+    switch (key_code) {
+      case KEY_ESC:
+        break;
+      case KEY_BTAB:
+      case KEY_TAB:
+        if (cur_object == (CDKOBJS*) search_term_entry) {
+          processSearch();
+        } else {
+          // Switch back to search_term_entry, leaving the results shown.
+          unsetFocus(cur_object);
+          drawCDKSelection(selection, 1);
+          focusSearchEntry();
+        }
+        break;
+      case 153: // Alt-H
+      case KEY_F1:
+        if (cur_object != (CDKOBJS*) search_term_entry) {
+          std::string error;
+          const MethodDescriptor* method_descriptor =
+              generation->catalog.resolve(found_methods[getSelectedRow()], &error);
+          if (method_descriptor == NULL) {
+            showInfoPanel(cdk_screen, error);
+            redraw();
+            break;
+          }
+          std::string debugString;
+          debugString += method_descriptor->file()->name();
+          debugString += "\n";
+          debugString += method_descriptor->full_name();
+          debugString += "\n";
+          debugString += generation->describe(method_descriptor);
+          debugString += "\n";
+
+          debugString += method_descriptor->input_type()->file()->name();
+          debugString += "\n";
+          debugString += method_descriptor->input_type()->full_name();
+          debugString += "\n";
+          debugString += generation->describe(method_descriptor->input_type());
+          debugString += "\n";
+
+          debugString += method_descriptor->output_type()->file()->name();
+          debugString += "\n";
+          debugString += method_descriptor->output_type()->full_name();
+          debugString += "\n";
+          debugString += generation->describe(method_descriptor->output_type());
+          showInfoPanel(cdk_screen, debugString);
+
+          // Switch back to search_term_entry after this returns.
+          redraw();
+        }
+        break;
+      case KEY_ENTER:
+        if (cur_object == (CDKOBJS*) search_term_entry) {
+          processSearch();
+        } else {
+          std::string error;
+          const MethodDescriptor* method_descriptor =
+              generation->catalog.resolve(found_methods[getSelectedRow()], &error);
+          if (method_descriptor == NULL) {
+            showInfoPanel(cdk_screen, error);
+            redraw();
+            break;
+          }
+          // In theory, we could support going back to this screen without recreating  it.
+          eraseCDKScreen(cdk_screen);
+          // Create the next screen and push it onto the stack.
+          RequestBuilderPage* request_builder_page =
+              new RequestBuilderPage(method_descriptor, generation, options);
+          page_stack.push_back(request_builder_page);
+        }
+        break;
+      default:
+        InjectObj(cur_object, key_code);
+    }
+    // Search again once the keys that have already been typed are handled.
+    if (cur_object == (CDKOBJS*) search_term_entry &&
+        searched_term != search_term_entry->info) {
+      search_pending = true;
+    }
+    return false;
+  }
+
+  virtual CDKOBJS* getCDKActiveObject() {
+    return cur_object;
+  }
+
+  /**
+   * Searching waits until there are no more keys to handle, so that a search
+   * is not run for each key of a paste or of fast typing. A search that is
+   * still running when another key arrives is given up, so that the key is
+   * handled right away, and the search starts over once keys stop again.
+   */
+  virtual int getIdleTimeout() {
+    return search_pending ? 0 : -1;
+  }
+
+  virtual void onIdle() {
+    if (search_pending && findMethods(true)) {
+      showResults();
+    }
+  }
+
+  virtual void redraw() {
+    // Save data and recreate cdk objects to support screen resizing.
+    bool has_selection = selection != NULL;
+    bool in_selection = has_selection && cur_object == (CDKOBJS*) selection;
+    int selected_row;
+    if (has_selection) {
+      selected_row = getSelectedRow();
+    }
+    char* search_box_content = strdup(search_term_entry->info);
+
+    // Destroy CDK objects
+    destroyCDKEntry(search_term_entry);
+    if (has_selection) {
+      destroyCDKSelection(selection);
+    }
+
+    // Recreate CDK objects
+    createSearchEntryOrDie();
+    setCDKEntryValue(search_term_entry, search_box_content);
+    // Draw again after restoring the value.
+    drawCDKEntry(search_term_entry, 1);
+    if (has_selection) {
+      createSelection();
+      if (in_selection) {
+        focusSelection();
+      }
+      selectRow(selected_row);
+    }
+
+    free(search_box_content);
+
+    // Redraw help text.
+    if (help_window != NULL) {
+      destroyCDKSwindow(help_window);
+    }
+    createHelpWindow();
+  };
+
+  /**
+   * Switch to a newly loaded generation of protos. Shown search results are
+   * refreshed, keeping the selected method selected if it still exists.
+   */
+  void setGeneration(std::shared_ptr<ProtoGeneration> generation) {
+    std::string selected_name;
+    if (selection != NULL) {
+      selected_name = found_methods[getSelectedRow()]->full_name;
+    }
+    this->generation = generation;
+    // The results came from the old generation, so they cannot be narrowed.
+    searched_term.clear();
+    found_methods.clear();
+    if (selection == NULL && search_term_entry->info[0] == '\0') {
+      return;
+    }
+
+    findMethods();
+    bool in_selection = selection != NULL && cur_object == (CDKOBJS*) selection;
+    showResults(selection != NULL);
+    if (in_selection && selection != NULL) {
+      int selected_row = 0;
+      for (int i = 0; i < found_methods.size(); i++) {
+        if (found_methods[i]->full_name == selected_name) {
+          selected_row = i;
+          break;
+        }
+      }
+      focusSelection();
+      selectRow(selected_row);
+    }
+  }
+
+  /**
+   * Show what is being loaded below the help text, or nothing if status is
+   * empty.
+   */
+  void setStatus(const std::string& status) {
+    if (status == this->status) {
+      return;
+    }
+    this->status = status;
+    if (help_window != NULL) {
+      destroyCDKSwindow(help_window);
+    }
     createHelpWindow();
+  }
+
+  /**
+   * Show a message in a panel on top of this page.
+   */
+  void showNotice(const std::string& notice) {
+    showInfoPanel(cdk_screen, notice);
+    redraw();
+  }
+
+private:
+  /**
+   * The display page stack, used for adding pages.
+   */
+  std::vector<UserFacingPage*>& page_stack;
+
+  /**
+   * The screen used for drawing CDK objects.
+   */
+  CDKSCREEN* cdk_screen;
+
+  /**
+   * The field where the search entry will be entered.
+   */
+  CDKENTRY* search_term_entry;
+
+  /**
+   * The window displaying the rows of found_methods from first_row on, as
+   * many as fit in visible_rows.
+   */
+  CDKSELECTION *selection;
+  int first_row;
+  int visible_rows;
+
+  /**
+   * The window where help text will be drawn.
+   */
+  CDKSWINDOW* help_window;
+
+  /**
+   * The items that are part of the selection. Since the sellection does not
+   * appear to own this memory and allocates new memory instead, we must own it
+   * instead.
+   */
+  std::vector<const char*> items;
+
+  /**
+   * The currently active GUI object that is receiving input.
+   */
+  CDKOBJS* cur_object;
+
+  /**
+   * The protos to search over.
+   */
+  std::shared_ptr<ProtoGeneration> generation;
+
+  /**
+   * The methods that match the search term.
+   */
+  std::vector<const MethodEntry*> found_methods;
+
+  /**
+   * The search term that found_methods holds the results for, or empty if
+   * found_methods is not the result of a search in the current generation.
+   */
+  std::string searched_term;
+
+  /**
+   * The number of matches for searched_term, which is more than found_methods
+   * holds if only the best ones were kept.
+   */
+  size_t match_count;
+
+  /**
+   * Whether the search box input changed since the last search.
+   */
+  bool search_pending;
+
+  /**
+   * What is being loaded, shown below the help text.
+   */
+  std::string status;
+
+  /**
+   * The command line options passed into the program.
+   */
+  const Options& options;
+
+  /**
+   * Finish any pending search for the search box input and move to its
+   * results. An empty search box lists every method.
+   */
+  void processSearch() {
+    if (search_pending || selection == NULL) {
+      findMethods();
+      showResults(true);
+    }
+
+    // Abort early if there are no results. Results that are still being
+    // loaded will be shown when they arrive.
+    if (found_methods.empty()) {
+      showInfoPanel(cdk_screen, status.empty()
+          ? "No results found!"
+          : "No results found yet. Protos are still being loaded.");
+      return;
+    }
+    focusSelection();
+  }
+
+  /**
+   * Fill found_methods with the best matches for the search box input. When
+   * the input extends the term of the current results and those are all the
+   * matches, every token is at least as specific as before, so only the
+   * current results are ranked again. Filter tokens are not narrowed that
+   * way, since ranking does not apply them. If cancellable, the search is
+   * given up as soon as input is waiting, leaving found_methods and
+   * search_pending as they were, and false is returned.
+   */
+  bool findMethods(bool cancellable = false) {
+    std::string term = search_term_entry->info;
+    std::vector<std::string> tokens = split(tolower(term).c_str());
+
+    bool cancelled = false;
+    MethodCatalog::CancelCheck input_waiting;
+    if (cancellable) {
+      input_waiting = [&cancelled] {
+        struct pollfd poll_fd = {STDIN_FILENO, POLLIN, 0};
+        cancelled = interrupted || poll(&poll_fd, 1, 0) > 0;
+        return cancelled;
+      };
+    }
+    size_t count;
+    std::vector<const MethodEntry*> found;
+    if (!searched_term.empty() && found_methods.size() == match_count &&
+        term.compare(0, searched_term.size(), searched_term) == 0 &&
+        std::none_of(tokens.begin(), tokens.end(), ProtoGeneration::isFilter)) {
+      found = MethodCatalog::rank(found_methods, tokens, &count, input_waiting);
+    } else {
+      found = generation->search(tokens, &count, input_waiting);
+    }
+    if (cancelled) {
+      return false;
+    }
+    search_pending = false;
+    found_methods.swap(found);
+    match_count = count;
+    searched_term = term;
+    return true;
+  }
+
+  /**
+   * Show found_methods below the search box, or nothing if there are none.
+   * If the results had the focus, it moves to the search box. The results of
+   * an empty search box are every method, which are only listed if list_all
+   * is true.
+   */
+  void showResults(bool list_all = false) {
+    if (selection != NULL) {
+      if (cur_object == (CDKOBJS*) selection) {
+        focusSearchEntry();
+      }
+      destroyCDKSelection(selection);
+      selection = NULL;
+      // Clear the rows of the old results.
+      refreshCDKScreen(cdk_screen);
+    }
+    if (found_methods.empty() || (searched_term.empty() && !list_all)) {
+      return;
+    }
+    first_row = 0;
+    createSelection();
+    drawCDKSelection(selection, 1);
+    drawCDKEntry(search_term_entry, 1);
+  }
+
+  /**
+   * Point items at the names of the rows of found_methods that are on screen.
+   */
+  void fillItems() {
+    items.clear();
+    for (int i = first_row; i < found_methods.size() && i < first_row + visible_rows; i++) {
+      items.push_back(found_methods[i]->full_name.c_str());
+    }
+  }
+
+  /**
+   * The row of found_methods that is selected.
+   */
+  int getSelectedRow() {
+    return first_row + getCDKSelectionCurrent(selection);
+  }
+
+  /**
+   * Select a row of found_methods, clamped to the rows there are, and scroll
+   * it into view. Only scrolling replaces the items of the selection, and
+   * only with the rows on screen, so this takes the same time however many
+   * results there are.
+   */
+  void selectRow(int row) {
+    row = std::max(0, std::min(row, (int) found_methods.size() - 1));
+    int first = first_row;
+    if (row < first) {
+      first = row;
+    } else if (row >= first + visible_rows) {
+      first = row - visible_rows + 1;
+    }
+    if (first != first_row) {
+      first_row = first;
+      fillItems();
+      setCDKSelectionItems(selection, (CDK_CSTRING2) items.data(), items.size());
+    }
+    setCDKSelectionCurrent(selection, row - first_row);
+    drawCDKSelection(selection, 1);
+  }
+
+  /**
+   * Helper function for creating the help section of this page.
+   */
+  void createHelpWindow() {
+    help_window = newCDKSwindow(cdk_screen, LEFT, num_rows - 5, status.empty() ? 4 : 5,
+        num_cols, "USAGE", 5, 0, 0);
+    if (help_window == 0) {
+      debugMsg(DEBUG_UI, DEBUG_ERROR, "Failed to create help window. Perhaps screen was too small.\n");
+      return;
+    }
+    std::string help_text =
+        "Type a Rpc name to search, and press ENTER to choose from the results."
+        "\nUP/DOWN Select\tENTER Choose\tTAB Move between windows"
+        "\nF1 View Rpc definition\tfield:, type: or uses:NAME Find Rpcs that use a field or type";
+    if (!status.empty()) {
+      help_text += "\n" + status;
+    }
+    showMultilineMessage(help_window, help_text);
+    drawCDKSwindow(help_window, 0);
+  }
+
+  /**
+   * Helper function for creating the search term entry.
+   */
+  void createSearchEntryOrDie() {
+    /* Create the entry field widget. */
+    search_term_entry = newCDKEntry (cdk_screen,
+        LEFT, TOP,
+        /*title=*/"", /*label=*/"", A_NORMAL, ' ', vMIXED,
+        num_cols, 0, 256,
+        TRUE, FALSE);
+
+    /* Is the widget null? */
+    if (search_term_entry == 0)
+    {
+      /* Clean up. */
+      destroyCDKScreen(cdk_screen);
+      endCDK ();
+
+      printf ("Cannot create the entry box. Is the window too small?\n");
+      exit(1);
+    }
+    drawCDKEntry(search_term_entry, 1);
+    cur_object = (CDKOBJS*) search_term_entry;
+  }
+
+  /**
+   * Move the focus to the search box.
+   */
+  void focusSearchEntry() {
+    cur_object = (CDKOBJS*) search_term_entry;
+    setFocus(cur_object);
+    setCDKFocusCurrent(cdk_screen, cur_object);
+  }
+
+  /**
+   * Move the focus to the selection box, which must exist.
+   */
+  void focusSelection() {
+    unsetFocus((CDKOBJS*) search_term_entry);
+    cur_object = setCDKFocusCurrent(cdk_screen, (CDKOBJS*) selection);
+    unsetFocus(cur_object);
+    setFocus(cur_object);
+  }
+
+  /**
+   * Helper function for creating the selection box, without focusing it. It
+   * shows the rows of found_methods from first_row on, under a title with how
+   * many there are.
+   */
+  void createSelection() {
+    static const char *choices[] = { "", "" };
+    int height = std::min(num_rows * 2 / 3, num_rows - ROWS_FOR_ONSCREEN_HELP - 1);
+    // The title and the top and bottom of the box take three of the rows.
+    visible_rows = std::max(1, height - 3);
+    first_row = std::max(0, std::min(first_row, (int) found_methods.size() - visible_rows));
+    fillItems();
+    std::string title = std::to_string(match_count) +
+        (match_count == 1 ? " match" : " matches");
+    if (found_methods.size() < match_count) {
+      title = "Best " + std::to_string(found_methods.size()) + " of " + title;
+    }
+    selection = newCDKSelection (cdk_screen,
+        LEFT,
+        3,
+        CDKparsePosition("RIGHT"),
+        height,
+        num_cols,
+        title.c_str(),
+        (CDK_CSTRING2) items.data(),
+        items.size(),
+        (CDK_CSTRING2) choices, 2,
+        A_REVERSE,
+        TRUE,
+        FALSE);
+
+    /* Is the selection list null? */
+    if (selection == 0)
+    {
+      /* Exit CDK. */
+      destroyCDKScreen (cdk_screen);
+      endCDK ();
+
+      printf ("Cannot to create the selection list.\n");
+      printf ("Is the window too small?\n");
+      exit(1);
+    }
+  }
+};
+
+/**
+ * Make sure there's enough of a window to render a meaningful UI. If that is
+ * not the case, end curses and return false, so the caller can exit.
+ */
+bool ensureMinWindowSize() {
+  if (num_rows < ROWS_FOR_ONSCREEN_HELP + 5) {
+    endCDK ();
+    printf("\n\nWindow is too small to render RpcExplorer.\n");
+    return false;
+  }
+  return true;
+}
+
+/**
+ * A queue of work items that are processed by a fixed number of threads.
+ * Processing an item may push more items, and run() returns once the queue is
+ * empty and no item is being processed.
+ */
+template <typename Item>
+class WorkQueue {
+public:
+  WorkQueue() : in_flight(0), stop(NULL) {}
+
+  /**
+   * Stop handing out items once *stop becomes true. The items that are being
+   * processed are finished, and the rest are dropped.
+   */
+  void setStopFlag(const std::atomic<bool>* stop) {
+    this->stop = stop;
+  }
+
+  /**
+   * Add an item. Thread-safe, including from within run().
+   */
+  void push(Item item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.push_back(std::move(item));
+    state_changed.notify_one();
+  }
+
+  /**
+   * Add an item ahead of the items that are already waiting. Thread-safe,
+   * including from within run().
+   */
+  void pushFront(Item item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.push_front(std::move(item));
+    state_changed.notify_one();
+  }
+
+  /**
+   * Process every item on jobs threads. process is called with the item and
+   * the index of the calling thread, which is in [0, jobs), so that callers
+   * can keep per-thread state.
+   */
+  void run(int jobs, const std::function<void(Item&, int)>& process) {
+    std::vector<std::thread> workers;
+    for (int i = 0; i < jobs; i++) {
+      workers.emplace_back([this, &process, i] { work(process, i); });
+    }
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+
+private:
+  /**
+   * Guards all of the members below.
+   */
+  std::mutex mutex;
+
+  /**
+   * Signaled when an item is pushed, and when the last running item finishes
+   * with nothing pending, which ends the run.
+   */
+  std::condition_variable state_changed;
+
+  /**
+   * Items that are waiting for a worker.
+   */
+  std::deque<Item> pending;
+
+  /**
+   * The number of items currently being processed.
+   */
+  int in_flight;
 
-    // Create the display on the right and initialize with empty JSON
-    json_display = newCDKSwindow(cdk_screen, RIGHT, TOP, num_rows - ROWS_FOR_ONSCREEN_HELP, num_cols / 2, "", 1000, 1, 0);
-    drawCDKSwindow(json_display, 1);
-    updateJsonDisplay();
+  /**
+   * Set when run() should end early, or NULL.
+   */
+  const std::atomic<bool>* stop;
+
+  void work(const std::function<void(Item&, int)>& process, int worker) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      state_changed.wait(lock, [this] { return !pending.empty() || in_flight == 0; });
+      if (stop != NULL && *stop && !pending.empty()) {
+        // Wake the other workers, which wait for the running items to finish
+        // now that nothing is pending.
+        pending.clear();
+        state_changed.notify_all();
+      }
+      if (pending.empty()) {
+        break;
+      }
+      Item item = std::move(pending.front());
+      pending.pop_front();
+      in_flight++;
 
-    // Set up the current focus
-    index = 0;
-    cur_object = setCDKFocusCurrent(cdk_screen, proto_cdk_fields[index]->field_cdk_obj);
-    setFocus(cur_object);
+      lock.unlock();
+      process(item, worker);
+      lock.lock();
+
+      in_flight--;
+      if (in_flight == 0 && pending.empty()) {
+        state_changed.notify_all();
+      }
+    }
+  }
+};
+
+/**
+ * Glob patterns of files and directories to skip while walking a directory
+ * tree. Rules are chained, so that the patterns of a .rpcexplorerignore file
+ * apply to its directory and everything below it, in addition to the patterns
+ * inherited from above.
+ */
+class IgnoreRules {
+public:
+  /**
+   * Create rules for the directory base, relative to the proto path, on top
+   * of the rules of its parent, which may be NULL.
+   */
+  IgnoreRules(std::shared_ptr<const IgnoreRules> parent, const std::string& base)
+      : parent(parent), base(base) {}
+
+  /**
+   * Add a pattern. Patterns without a slash match an entry name at any depth.
+   * Patterns with a slash match the path relative to base. A trailing slash
+   * restricts the pattern to directories.
+   */
+  void add(std::string pattern) {
+    Pattern rule;
+    rule.directory_only = !pattern.empty() && pattern.back() == '/';
+    while (!pattern.empty() && pattern.back() == '/') {
+      pattern.pop_back();
+    }
+    if (pattern.empty()) {
+      return;
+    }
+    rule.match_path = pattern.find('/') != std::string::npos;
+    if (pattern[0] == '/') {
+      pattern.erase(0, 1);
+    }
+    rule.glob = pattern;
+    patterns.push_back(rule);
+  }
+
+  /**
+   * Add the patterns in an ignore file, one per line. Blank lines and lines
+   * starting with # are skipped.
+   */
+  void addFile(const std::string& path) {
+    std::ifstream input(path);
+    for (std::string line; std::getline(input, line);) {
+      while (!line.empty() && isspace((unsigned char) line.back())) {
+        line.pop_back();
+      }
+      if (!line.empty() && line[0] != '#') {
+        add(line);
+      }
+    }
+  }
+
+  bool empty() const {
+    return patterns.empty();
+  }
+
+  /**
+   * Whether the entry at path, relative to the proto path, should be skipped.
+   */
+  bool ignores(const std::string& path, const std::string& name, bool is_directory) const {
+    for (const IgnoreRules* rules = this; rules != NULL; rules = rules->parent.get()) {
+      std::string relative_path = rules->base.empty()
+          ? path : path.substr(rules->base.size() + 1);
+      for (const Pattern& rule : rules->patterns) {
+        if (rule.directory_only && !is_directory) {
+          continue;
+        }
+        const std::string& subject = rule.match_path ? relative_path : name;
+        if (fnmatch(rule.glob.c_str(), subject.c_str(), FNM_PATHNAME) == 0) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+private:
+  struct Pattern {
+    std::string glob;
+    bool match_path;
+    bool directory_only;
+  };
+
+  std::shared_ptr<const IgnoreRules> parent;
+
+  /**
+   * The directory that the patterns are relative to, relative to the proto
+   * path. Empty for the proto path itself.
+   */
+  std::string base;
+
+  std::vector<Pattern> patterns;
+};
+
+/**
+ * Finds the proto files under a list of proto paths, reading directories in
+ * parallel. Symlinks are followed, except for those that lead back into a
+ * directory that is being walked. Each proto file is returned once, relative
+ * to the first proto path that contains it, even if proto paths overlap.
+ */
+class ProtoPathWalker {
+public:
+  ProtoPathWalker(const std::vector<const char*>& proto_paths,
+      const std::vector<std::string>& excludes,
+      int jobs)
+      : proto_paths(proto_paths)
+      , excludes(excludes)
+      , jobs(jobs) {}
+
+  /**
+   * Stop walking once *stop becomes true, and return what was found so far.
+   */
+  void setStopFlag(const std::atomic<bool>* stop) {
+    queue.setStopFlag(stop);
+  }
+
+  /**
+   * A directory that was walked.
+   */
+  struct WalkedDirectory {
+    /**
+     * The index of the proto path the directory is in.
+     */
+    int root;
+
+    /**
+     * The path of the directory relative to the proto path.
+     */
+    std::string path;
+
+    /**
+     * The ignore rules that apply to the directory's entries.
+     */
+    std::shared_ptr<const IgnoreRules> rules;
+  };
+
+  /**
+   * Walk the proto paths and return the proto files found, relative to their
+   * proto path, ordered by proto path and then by name.
+   */
+  std::vector<std::string> walk() {
+    std::shared_ptr<const IgnoreRules> rules = excludeRules();
+    for (int i = 0; i < proto_paths.size(); i++) {
+      queue.push(Directory{i, "", rules, {}});
+    }
+    return collect();
+  }
+
+  /**
+   * Walk only the directory at path below the proto path with index root, such
+   * as a directory that was created after the proto paths were walked. The
+   * ignore files of the directories above it apply.
+   */
+  std::vector<std::string> walk(int root, const std::string& path) {
+    std::shared_ptr<const IgnoreRules> rules = excludeRules();
+    std::string base;
+    while (true) {
+      std::string ignore_file = proto_paths[root];
+      if (!base.empty()) {
+        ignore_file += "/" + base;
+      }
+      ignore_file += "/.rpcexplorerignore";
+      std::shared_ptr<IgnoreRules> own_rules(new IgnoreRules(rules, base));
+      own_rules->addFile(ignore_file);
+      if (!own_rules->empty()) {
+        rules = own_rules;
+      }
+      size_t slash = path.find('/', base.empty() ? 0 : base.size() + 1);
+      if (slash == std::string::npos) {
+        break;
+      }
+      base = path.substr(0, slash);
+    }
+    queue.push(Directory{root, path, rules, {}});
+    return collect();
+  }
+
+  /**
+   * Return the directories walked so far and forget them.
+   */
+  std::vector<WalkedDirectory> takeDirectories() {
+    std::vector<WalkedDirectory> result;
+    result.swap(directories);
+    return result;
+  }
+
+private:
+  std::shared_ptr<const IgnoreRules> excludeRules() {
+    std::shared_ptr<IgnoreRules> rules(new IgnoreRules(NULL, ""));
+    for (const std::string& exclude : excludes) {
+      rules->add(exclude);
+    }
+    return rules;
+  }
+
+  /**
+   * Walk the queued directories and return the proto files found.
+   */
+  std::vector<std::string> collect() {
+    queue.run(jobs, [this](Directory& directory, int) { walkDirectory(directory); });
+
+    std::sort(found.begin(), found.end(), [](const ProtoFile& a, const ProtoFile& b) {
+      return a.root != b.root ? a.root < b.root : a.path < b.path;
+    });
+    std::vector<std::string> filenames;
+    std::set<std::string> seen_paths;
+    std::set<std::pair<dev_t, ino_t>> seen_files;
+    for (const ProtoFile& file : found) {
+      if (seen_paths.insert(file.path).second &&
+          seen_files.insert(std::make_pair(file.device, file.inode)).second) {
+        filenames.push_back(file.path);
+      }
+    }
+    found.clear();
+    return filenames;
+  }
+
+  /**
+   * A directory waiting to be read.
+   */
+  struct Directory {
+    /**
+     * The index of the proto path the directory is in.
+     */
+    int root;
+
+    /**
+     * The path of the directory relative to the proto path.
+     */
+    std::string path;
+
+    /**
+     * The ignore rules that apply to the directory's entries.
+     */
+    std::shared_ptr<const IgnoreRules> rules;
+
+    /**
+     * The device and inode of each directory above this one, to detect
+     * symlink loops.
+     */
+    std::vector<std::pair<dev_t, ino_t>> ancestors;
+  };
+
+  struct ProtoFile {
+    int root;
+    std::string path;
+    dev_t device;
+    ino_t inode;
+  };
+
+  const std::vector<const char*>& proto_paths;
+  const std::vector<std::string>& excludes;
+  int jobs;
+
+  WorkQueue<Directory> queue;
+
+  /**
+   * Guards found and directories.
+   */
+  std::mutex mutex;
+  std::vector<ProtoFile> found;
+  std::vector<WalkedDirectory> directories;
+
+  void walkDirectory(Directory& directory) {
+    std::string disk_path = proto_paths[directory.root];
+    if (!directory.path.empty()) {
+      disk_path += "/" + directory.path;
+    }
+    DIR* dir = opendir(disk_path.c_str());
+    if (dir == NULL) {
+      if (directory.path.empty()) {
+        std::cerr << "Unable to read proto path " << disk_path << ": " <<
+            strerror(errno) << std::endl;
+      }
+      return;
+    }
+    struct stat dir_stat;
+    if (fstat(dirfd(dir), &dir_stat) != 0) {
+      closedir(dir);
+      return;
+    }
+    std::pair<dev_t, ino_t> dir_id(dir_stat.st_dev, dir_stat.st_ino);
+    for (const std::pair<dev_t, ino_t>& ancestor : directory.ancestors) {
+      if (ancestor == dir_id) {
+        // A symlink led back into a directory we are already inside of.
+        closedir(dir);
+        return;
+      }
+    }
+
+    // Read all entries first, so that an ignore file applies regardless of
+    // where it appears in the listing.
+    struct Entry {
+      std::string name;
+      unsigned char type;
+      ino_t inode;
+    };
+    std::vector<Entry> entries;
+    bool has_ignore_file = false;
+    for (struct dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name == "." || name == "..") {
+        continue;
+      }
+      if (name == ".rpcexplorerignore") {
+        has_ignore_file = true;
+      }
+      entries.push_back(Entry{name, entry->d_type, entry->d_ino});
+    }
+    closedir(dir);
+
+    std::shared_ptr<const IgnoreRules> rules = directory.rules;
+    if (has_ignore_file) {
+      std::shared_ptr<IgnoreRules> own_rules(new IgnoreRules(rules, directory.path));
+      own_rules->addFile(disk_path + "/.rpcexplorerignore");
+      if (!own_rules->empty()) {
+        rules = own_rules;
+      }
+    }
+
+    std::vector<std::pair<dev_t, ino_t>> ancestors = directory.ancestors;
+    ancestors.push_back(dir_id);
+    std::vector<ProtoFile> protos;
+    for (const Entry& entry : entries) {
+      const std::string& name = entry.name;
+      bool is_proto = name.size() > 6 && name.compare(name.size() - 6, 6, ".proto") == 0;
+      bool is_directory = entry.type == DT_DIR;
+      bool is_regular_file = entry.type == DT_REG;
+      dev_t device = dir_stat.st_dev;
+      ino_t inode = entry.inode;
+      // Symlinks and file systems that do not report types need a stat to
+      // find out what the entry is. Everything else is decided without one,
+      // which matters on network file systems.
+      if (entry.type == DT_LNK || entry.type == DT_UNKNOWN) {
+        struct stat entry_stat;
+        if (stat((disk_path + "/" + name).c_str(), &entry_stat) != 0) {
+          continue;
+        }
+        is_directory = S_ISDIR(entry_stat.st_mode);
+        is_regular_file = S_ISREG(entry_stat.st_mode);
+        device = entry_stat.st_dev;
+        inode = entry_stat.st_ino;
+      }
+      if (!is_directory && !(is_regular_file && is_proto)) {
+        continue;
+      }
+      std::string path = directory.path.empty() ? name : directory.path + "/" + name;
+      if (rules->ignores(path, name, is_directory)) {
+        continue;
+      }
+      if (is_directory) {
+        queue.push(Directory{directory.root, path, rules, ancestors});
+      } else {
+        protos.push_back(ProtoFile{directory.root, path, device, inode});
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (ProtoFile& proto : protos) {
+      found.push_back(std::move(proto));
+    }
+    directories.push_back(WalkedDirectory{directory.root, directory.path, rules});
+  }
+};
+
+/**
+ * Identifies the version of a proto file on disk, so that a cached parse of the
+ * file can be reused as long as the file is unchanged.
+ */
+struct FileStamp {
+  /**
+   * The path that the file's virtual name resolved to. A file that starts
+   * shadowing this one in an earlier proto path changes this.
+   */
+  std::string disk_path;
+
+  /**
+   * Modification time in nanoseconds.
+   */
+  int64_t mtime;
+
+  /**
+   * Size in bytes.
+   */
+  int64_t size;
+
+  bool operator==(const FileStamp& other) const {
+    return disk_path == other.disk_path && mtime == other.mtime && size == other.size;
+  }
+};
+
+/**
+ * Resolve a virtual proto filename against the proto paths the same way that
+ * DiskSourceTree does, by taking the first proto path that contains it, and
+ * stamp the result. Returns false if the file does not exist.
+ */
+bool stampProtoFile(const std::vector<const char*>& proto_paths,
+    const std::string& filename, FileStamp* stamp) {
+  for (const char* proto_path : proto_paths) {
+    std::string disk_path = std::string(proto_path) + "/" + filename;
+    struct stat st;
+    if (stat(disk_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    stamp->disk_path = disk_path;
+#ifdef __APPLE__
+    stamp->mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    stamp->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    stamp->size = st.st_size;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * A persistent cache of parsed proto files, stored as a single file per set of
+ * proto paths under the cache directory. The file starts with a text manifest
+ * that has one line per proto file containing its stamp, followed by a
+ * serialized FileDescriptorSet with the parsed files in the same order.
+ *
+ * Only files whose stamp is unchanged are served from the cache. Parsing a
+ * proto file does not depend on its imports, so the files that import a
+ * changed file can still be served from the cache; they are linked against the
+ * new version when the DescriptorPool is built.
+ */
+class ProtoCache {
+public:
+  /**
+   * Constructor. Parses without source info are cached separately, so that
+   * switching --lazy_comments does not lose comments or invalidate the cache.
+   */
+  ProtoCache(const std::string& cache_dir,
+      const std::vector<const char*>& proto_paths,
+      bool keep_source_info)
+      : proto_paths(proto_paths)
+      , cache_path(cache_dir + "/" + protoPathsKey(proto_paths) +
+          (keep_source_info ? ".cache" : ".nosource.cache"))
+      , dirty(false) {}
+
+  /**
+   * Read the cache file if it exists. A missing or corrupt cache is treated as
+   * empty.
+   */
+  void load() {
+    std::ifstream input(cache_path, std::ios::binary);
+    std::string line;
+    if (!std::getline(input, line) || line != header()) {
+      return;
+    }
+    std::vector<std::pair<std::string, FileStamp>> manifest;
+    while (std::getline(input, line) && !line.empty()) {
+      // name \t disk_path \t mtime \t size
+      std::vector<std::string> columns;
+      std::istringstream columns_stream(line);
+      for (std::string column; std::getline(columns_stream, column, '\t');) {
+        columns.push_back(column);
+      }
+      if (columns.size() != 4) {
+        return;
+      }
+      FileStamp stamp = {columns[1], atoll(columns[2].c_str()), atoll(columns[3].c_str())};
+      manifest.emplace_back(columns[0], stamp);
+    }
+
+    FileDescriptorSet file_set;
+    if (!file_set.ParseFromIstream(&input) ||
+        file_set.file_size() != (int) manifest.size()) {
+      return;
+    }
+    // Release from the back, which is the cheap end of a RepeatedPtrField.
+    for (int i = file_set.file_size() - 1; i >= 0; i--) {
+      Entry& entry = entries[manifest[i].first];
+      entry.stamp = manifest[i].second;
+      entry.file.reset(file_set.mutable_file()->ReleaseLast());
+    }
+  }
+
+  /**
+   * If the cache holds an up to date parse of filename, move it into output
+   * and return true. Each file may be looked up at most once. Thread-safe.
+   */
+  bool lookup(const std::string& filename, FileDescriptorProto* output) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = entries.find(filename);
+    if (it == entries.end() || it->second.file == NULL) {
+      return false;
+    }
+    FileStamp cached_stamp = it->second.stamp;
+    lock.unlock();
+
+    FileStamp stamp;
+    bool fresh = stampProtoFile(proto_paths, filename, &stamp) && stamp == cached_stamp;
+
+    lock.lock();
+    if (!fresh) {
+      entries.erase(it);
+      dirty = true;
+      return false;
+    }
+    output->Swap(it->second.file.get());
+    it->second.file.reset();
+    return true;
+  }
+
+  /**
+   * Record that filename was parsed from a file with the given stamp.
+   * Thread-safe.
+   */
+  void record(const std::string& filename, const FileStamp& stamp) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry& entry = entries[filename];
+    entry.stamp = stamp;
+    entry.file.reset();
+    dirty = true;
+  }
+
+  /**
+   * Write the cache back to disk if anything changed. files holds the files
+   * used in this run; cached files that were not used are kept as they are.
+   */
+  void save(const FileMap& files) {
+    if (!dirty) {
+      return;
+    }
+
+    // Serialize the FileDescriptorSet by hand, so that files can be written
+    // without first being copied into a FileDescriptorSet.
+    std::string manifest = header() + "\n";
+    std::string file_set;
+    google::protobuf::io::StringOutputStream file_set_stream(&file_set);
+    google::protobuf::io::CodedOutputStream file_set_output(&file_set_stream);
+    for (auto& name_and_entry : entries) {
+      const std::string& name = name_and_entry.first;
+      Entry& entry = name_and_entry.second;
+      const FileDescriptorProto* file = entry.file.get();
+      if (file == NULL) {
+        auto it = files.find(name);
+        if (it == files.end()) {
+          continue;
+        }
+        file = it->second.get();
+      }
+      file_set_output.WriteTag(
+          FileDescriptorSet::kFileFieldNumber << 3 |
+          google::protobuf::internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+      file_set_output.WriteVarint32(file->ByteSizeLong());
+      file->SerializeWithCachedSizes(&file_set_output);
+
+      manifest += name + "\t" + entry.stamp.disk_path + "\t" +
+          std::to_string(entry.stamp.mtime) + "\t" +
+          std::to_string(entry.stamp.size) + "\n";
+    }
+    file_set_output.Trim();
+    manifest += "\n";
+
+    // Write to a temporary file and rename it into place, so that concurrent
+    // runs never observe a partially written cache.
+    std::error_code ec;
+    std::filesystem::create_directories(
+        std::filesystem::path(cache_path).parent_path(), ec);
+    std::string temp_path = cache_path + "." + std::to_string(getpid());
+    {
+      std::ofstream output(temp_path, std::ios::binary | std::ios::trunc);
+      output << manifest << file_set;
+      if (!output) {
+        output.close();
+        std::filesystem::remove(temp_path, ec);
+        return;
+      }
+    }
+    std::filesystem::rename(temp_path, cache_path, ec);
+    dirty = false;
+  }
+
+private:
+  struct Entry {
+    FileStamp stamp;
+
+    /**
+     * The cached parse, or NULL once it has been handed out or if the file
+     * was parsed in this run.
+     */
+    std::unique_ptr<FileDescriptorProto> file;
+  };
+
+  /**
+   * The first line of a cache file. Parses produced by other versions of
+   * protobuf are not trusted.
+   */
+  static std::string header() {
+    return "RpcExplorer proto cache 1 protobuf " +
+        std::to_string(GOOGLE_PROTOBUF_VERSION);
+  }
+
+  /**
+   * The directories that cached files are resolved against.
+   */
+  const std::vector<const char*>& proto_paths;
+
+  /**
+   * The location of the cache file for this set of proto paths.
+   */
+  std::string cache_path;
+
+  /**
+   * Guards entries and dirty.
+   */
+  std::mutex mutex;
+
+  /**
+   * Cached files by virtual filename.
+   */
+  std::map<std::string, Entry> entries;
+
+  /**
+   * True if the contents on disk no longer match entries.
+   */
+  bool dirty;
+};
+
+/**
+ * Collects timings while loading protos at startup, and writes them as a report
+ * that shows which files dominate the load time.
+ */
+class StartupProfile {
+public:
+  /**
+   * Record the duration of a phase of loading, such as walking or parsing.
+   */
+  void recordPhase(const std::string& phase, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    phases.emplace_back(phase, seconds);
+  }
+
+  /**
+   * Record the time spent reading and parsing a file. Thread-safe.
+   */
+  void recordParse(const std::string& filename, double read_seconds,
+      double parse_seconds, bool cached) {
+    std::lock_guard<std::mutex> lock(mutex);
+    FileTimes& times = file_times[filename];
+    times.read = read_seconds;
+    times.parse = parse_seconds;
+    times.cached = cached;
+  }
+
+  /**
+   * Record the time spent building a file, not counting its imports.
+   */
+  void recordBuild(const std::string& filename, double seconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    file_times[filename].build = seconds;
+  }
+
+  /**
+   * Write the report for the loaded files to path, or to stderr if path is -.
+   * Returns false and sets error if the report cannot be written.
+   */
+  bool write(const std::string& path, const FileMap& files, std::string* error) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<FileReport> reports = analyze(files);
+    bool json = path.size() > 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    std::string report = json ? toJson(reports) : toText(reports);
+    if (path == "-") {
+      std::cerr << report;
+      return true;
+    }
+    std::ofstream output(path, std::ios::trunc);
+    output << report;
+    if (!output) {
+      *error = "Unable to write the startup profile to " + path + ".\n";
+      return false;
+    }
+    return true;
   }
 
+private:
+  /**
+   * The number of files listed in each ranking of the report.
+   */
+  static const int kTopFiles = 20;
+
+  struct FileTimes {
+    FileTimes() : read(0), parse(0), build(0), cached(false) {}
+    double read;
+    double parse;
+    double build;
+    bool cached;
+  };
+
+  struct FileReport {
+    std::string name;
+    FileTimes times;
+    int dependencies;
+    int transitive_dependencies;
+    int importers;
+    int transitive_importers;
+
+    double total() const {
+      return times.read + times.parse + times.build;
+    }
+  };
+
   /**
-   * Destructor.
+   * Guards all of the members below.
    */
-  ~RequestBuilderPage() {
-    for (ProtoCDKField* proto_cdk_field : proto_cdk_fields) {
-      if (proto_cdk_field->field_cdk_obj != NULL) {
-        // Assuming it is always a button is not quite kosher, but hopefully
-        // the macros will find the true type and do the right thing.
-        destroyCDKObject((CDKBUTTON*)proto_cdk_field->field_cdk_obj);
-        proto_cdk_field->field_cdk_obj = NULL;
-      }
-      if (proto_cdk_field->field_label_string != NULL) {
-        delete[] proto_cdk_field->field_label_string;
-        proto_cdk_field->field_label_string = NULL;
-      }
-      if (proto_cdk_field->field_cdk_label != NULL) {
-        destroyCDKObject(proto_cdk_field->field_cdk_label);
-        proto_cdk_field->field_cdk_label = NULL;
+  std::mutex mutex;
+  std::vector<std::pair<std::string, double>> phases;
+  std::map<std::string, FileTimes> file_times;
+
+  /**
+   * Combine the timings with the dependency counts of each file.
+   */
+  std::vector<FileReport> analyze(const FileMap& files) {
+    std::unordered_map<std::string, int> indexes;
+    std::vector<const FileDescriptorProto*> protos;
+    for (const auto& name_and_file : files) {
+      indexes[name_and_file.first] = protos.size();
+      protos.push_back(name_and_file.second.get());
+    }
+    std::vector<std::vector<int>> imports(protos.size());
+    for (int i = 0; i < protos.size(); i++) {
+      for (const std::string& dependency : protos[i]->dependency()) {
+        auto it = indexes.find(dependency);
+        if (it != indexes.end()) {
+          imports[i].push_back(it->second);
+        }
       }
-      delete proto_cdk_field;
     }
-    proto_cdk_fields.clear();
 
-    destroyCDKSwindow(json_display);
-    json_display = NULL;
+    // Closures are memoized, since files that import the same hub share most
+    // of their closure.
+    std::vector<std::vector<int>> closures(protos.size());
+    std::vector<char> state(protos.size(), 0);  // 0 new, 1 visiting, 2 done
+    std::function<const std::vector<int>&(int)> closure = [&](int i) -> const std::vector<int>& {
+      if (state[i] != 0) {
+        return closures[i];
+      }
+      state[i] = 1;
+      std::vector<int> result;
+      for (int dependency : imports[i]) {
+        result.push_back(dependency);
+        const std::vector<int>& nested = closure(dependency);
+        result.insert(result.end(), nested.begin(), nested.end());
+      }
+      std::sort(result.begin(), result.end());
+      result.erase(std::unique(result.begin(), result.end()), result.end());
+      closures[i] = std::move(result);
+      state[i] = 2;
+      return closures[i];
+    };
 
-    if (help_window != NULL) {
-      destroyCDKSwindow(help_window);
-      help_window = NULL;
+    std::vector<FileReport> reports(protos.size());
+    for (int i = 0; i < protos.size(); i++) {
+      reports[i].name = protos[i]->name();
+      reports[i].dependencies = imports[i].size();
+      reports[i].importers = 0;
+      reports[i].transitive_importers = 0;
     }
-
-    destroyCDKScreen(cdk_screen);
-    cdk_screen = NULL;
+    for (int i = 0; i < protos.size(); i++) {
+      const std::vector<int>& dependencies = closure(i);
+      reports[i].transitive_dependencies = dependencies.size();
+      for (int dependency : dependencies) {
+        reports[dependency].transitive_importers++;
+      }
+      for (int dependency : imports[i]) {
+        reports[dependency].importers++;
+      }
+      auto times = file_times.find(reports[i].name);
+      if (times != file_times.end()) {
+        reports[i].times = times->second;
+      }
+    }
+    return reports;
   }
 
-  virtual bool handleInput(int key_code, int function_key) {
-    ProtoCDKField* proto_cdk_field = proto_cdk_fields[index];
-    switch (key_code){
-      case KEY_BTAB:
-      case KEY_UP:
-        focusPrevious();
-        break;
-      case KEY_TAB:
-      case KEY_DOWN:
-        focusNext();
-        break;
-      case 153: // Alt-H
-      case KEY_F1:
-        if (proto_cdk_field->field_cdk_type != ENTRY &&
-            proto_cdk_field->field_cdk_type != EXPAND_BUTTON &&
-            proto_cdk_field->field_cdk_type != ADD_BUTTON) {
-          break;
-        }
-        // Show the definition for the current field if it's an enum or message
-        if (proto_cdk_field->field_descriptor->type() == FieldDescriptor::Type::TYPE_ENUM) {
-          DebugStringOptions options;
-          options.include_comments = true;
-          std::string debugString = proto_cdk_field->field_descriptor->enum_type()->DebugStringWithOptions(options);
-          showInfoPanel(cdk_screen, debugString);
-        } else if (proto_cdk_field->field_descriptor->type() == FieldDescriptor::Type::TYPE_MESSAGE) {
-          DebugStringOptions options;
-          options.include_comments = true;
-          std::string debugString = proto_cdk_field->field_descriptor->message_type()->DebugStringWithOptions(options);
-          showInfoPanel(cdk_screen, debugString);
-        } else {
-          // Show the definition of the enclosing message
-          DebugStringOptions options;
-          options.include_comments = true;
-          std::string debugString = proto_cdk_field->field_descriptor->containing_type()->DebugStringWithOptions(options);
-          showInfoPanel(cdk_screen, debugString);
-        }
-        break;
-      case KEY_ENTER:
-        // Check if we are a button.
-        proto_cdk_field = proto_cdk_fields[index];
-        if (proto_cdk_field->field_cdk_type == EXPAND_BUTTON) {
-          // Hide the button
-          proto_cdk_field->hide_expand = 1;
-          const Descriptor* input_descriptor = proto_cdk_field->field_descriptor->message_type();
-          debugMsg("Added children to field %s\n", input_descriptor->full_name().c_str());
-          for (int i = 0; i < input_descriptor->field_count(); i++) {
-            const FieldDescriptor* field_descriptor = input_descriptor->field(i);
-            debugMsg("Adding child %s\n", field_descriptor->full_name().c_str());
-            proto_cdk_field->children.push_back(
-                addDescriptorToDisplay(field_descriptor, proto_cdk_field->tab_index + 1, index + 1 + i));
-          }
-          debugMsg("Added %d children to field. Ending children %d\n",
-              input_descriptor->field_count(),
-              proto_cdk_field->children.size());
-          redrawProtoCdkFields(index + 1);
-          ProtoCDKField* prev = proto_cdk_field;
-          focusNext();
-          destroyCDKButton((CDKBUTTON*)prev->field_cdk_obj);
-          prev->field_cdk_obj = NULL;
-          setFocus(cur_object);
-        } else if (proto_cdk_field->field_cdk_type == ADD_BUTTON) {
-          // Add a copy of the repeated field
-          proto_cdk_field->children.push_back(
-              addDescriptorToDisplay(
-                proto_cdk_field->field_descriptor,
-                proto_cdk_field->tab_index + 1, index + 1, /*child_of_repeated*/1));
-          redrawProtoCdkFields(index + 1);
-          focusNext();
-        } else if (proto_cdk_field->field_cdk_type == REQUEST_BUTTON) {
-          std::string path =
-              exportScript(options.request_template, cdk_screen, method_descriptor, root_proto_cdk_fields, options.protoPaths);
+  std::vector<const FileReport*> slowest(const std::vector<FileReport>& reports) {
+    return top(reports, [](const FileReport* a, const FileReport* b) {
+      return a->total() > b->total();
+    });
+  }
 
-          char cmd_buffer[1024];
-          // Update permissions
-          snprintf(cmd_buffer, sizeof(cmd_buffer), "chmod u+x '%s'", path.c_str());
-          system(cmd_buffer);
-          // Execute script
-          // Redirect stdin to prevent subprocesses from accessing our tty and
-          // setting the foreground process group ID.
-          // When subprocesses do this, RpcExplorer can appear to become
-          // unresponsive because they steal input and signals from
-          // RpcExplorer.
-          snprintf(cmd_buffer, sizeof(cmd_buffer), "'%s' 2>&1 < /dev/null", path.c_str());
-          debugMsg("Start executing generated script %s.\n", cmd_buffer);
-          std::string cmd_output = exec_cmd(cmd_buffer);
-          debugMsg("Finished executing script.\n");
-          debugMsg("Script output:\n'''\n%s\n'''\n", cmd_output.c_str());
-          // Clean up script
-          snprintf(cmd_buffer, sizeof(cmd_buffer), "rm -f '%s'", path.c_str());
-          system(cmd_buffer);
-          showInfoPanel(cdk_screen, cmd_output);
-          debugMsg("Finished showing command output.");
-        } else if (proto_cdk_field->field_cdk_type == EXPORT_BUTTON) {
-          std::string path =
-              exportScript(options.request_template, cdk_screen, method_descriptor, root_proto_cdk_fields, options.protoPaths, 1);
+  std::vector<const FileReport*> mostImported(const std::vector<FileReport>& reports) {
+    return top(reports, [](const FileReport* a, const FileReport* b) {
+      return a->transitive_importers > b->transitive_importers;
+    });
+  }
 
-          // Path contained a single quote.
-          // This check is not needed above because we did not try to export to
-          // a filename that the user provided.
-          if (path.empty()) {
-            showInfoPanel(cdk_screen, "Filenames cannot contain single quote characters.");
-            break;
-          }
+  template <typename Compare>
+  std::vector<const FileReport*> top(const std::vector<FileReport>& reports, Compare compare) {
+    std::vector<const FileReport*> result;
+    for (const FileReport& report : reports) {
+      result.push_back(&report);
+    }
+    size_t count = std::min(result.size(), (size_t) kTopFiles);
+    std::partial_sort(result.begin(), result.begin() + count, result.end(), compare);
+    result.resize(count);
+    return result;
+  }
 
-          char cmd_buffer[1024];
-          // Update permissions
-          snprintf(cmd_buffer, sizeof(cmd_buffer), "chmod u+x '%s'", path.c_str());
-          system(cmd_buffer);
+  static std::string milliseconds(double seconds) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.3f", seconds * 1000);
+    return buffer;
+  }
 
-          char cmd_output[1024];
-          snprintf(cmd_output, sizeof(cmd_output), "Wrote script file to '%s'!", path.c_str());
-          showInfoPanel(cdk_screen, cmd_output);
-        }
-        break;
-      case CDK_REFRESH:
-        /* redraw screen */
-        redraw();
-        break;
-      case KEY_ESC:
-      case KEY_F7:
-        return true;
-      default:
-        InjectObj(cur_object, key_code);
+  static std::string jsonString(const std::string& input) {
+    std::string output = "\"";
+    for (unsigned char c : input) {
+      if (c == '"' || c == '\\') {
+        output += '\\';
+        output += c;
+      } else if (c < 0x20) {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+        output += buffer;
+      } else {
+        output += c;
+      }
     }
-    debugMsg("index = %d\n", index);
-    updateJsonDisplay();
-    setFocus(cur_object);
-    return false;
+    return output + "\"";
   }
 
-  virtual void redraw() {
-    // This is needed in case the window is resized.
-    max_row_to_display = min_row_to_display + (num_rows - ROWS_FOR_ONSCREEN_HELP);
-    // Ensure that we scroll the window down enough to see the currently
-    // selected object.
-    while (proto_cdk_fields[index]->field_virtual_row > max_row_to_display) {
-      max_row_to_display++;
-      min_row_to_display++;
-    }
+  static std::string jsonFile(const FileReport& report) {
+    return "{\"name\": " + jsonString(report.name) +
+        ", \"read_ms\": " + milliseconds(report.times.read) +
+        ", \"parse_ms\": " + milliseconds(report.times.parse) +
+        ", \"build_ms\": " + milliseconds(report.times.build) +
+        ", \"cached\": " + (report.times.cached ? "true" : "false") +
+        ", \"dependencies\": " + std::to_string(report.dependencies) +
+        ", \"transitive_dependencies\": " + std::to_string(report.transitive_dependencies) +
+        ", \"importers\": " + std::to_string(report.importers) +
+        ", \"transitive_importers\": " + std::to_string(report.transitive_importers) + "}";
+  }
 
-    // Destroy help first so that the destruction of help does not erase the
-    // fields that were in its former location.
-    if (help_window != NULL) {
-      destroyCDKSwindow(help_window);
+  std::string toJson(const std::vector<FileReport>& reports) {
+    std::string json = "{\n  \"phases_ms\": {";
+    for (int i = 0; i < phases.size(); i++) {
+      json += (i == 0 ? "" : ", ") + jsonString(phases[i].first) + ": " +
+          milliseconds(phases[i].second);
     }
-
-    // Recreate the JSON display to handle resizing events.
-    if (json_display != NULL) {
-      destroyCDKSwindow(json_display);
-      json_display = NULL;
+    json += "},\n  \"files\": [";
+    for (int i = 0; i < reports.size(); i++) {
+      json += (i == 0 ? "\n    " : ",\n    ") + jsonFile(reports[i]);
     }
+    json += "\n  ],\n  \"slowest\": [";
+    std::vector<const FileReport*> ranked = slowest(reports);
+    for (int i = 0; i < ranked.size(); i++) {
+      json += (i == 0 ? "" : ", ") + jsonString(ranked[i]->name);
+    }
+    json += "],\n  \"most_imported\": [";
+    ranked = mostImported(reports);
+    for (int i = 0; i < ranked.size(); i++) {
+      json += (i == 0 ? "" : ", ") + jsonString(ranked[i]->name);
+    }
+    return json + "]\n}\n";
+  }
 
-    redrawProtoCdkFields(0);
-    json_display = newCDKSwindow(cdk_screen, RIGHT, TOP, num_rows - ROWS_FOR_ONSCREEN_HELP,
-        num_cols / 2, "", 1000, 1, 0);
-    drawCDKSwindow(json_display, 1);
-    updateJsonDisplay();
-
-    createHelpWindow();
-    cur_object = setCDKFocusCurrent(cdk_screen, proto_cdk_fields[index]->field_cdk_obj);
-    if (cur_object) {
-      setFocus(cur_object);
+  std::string toText(const std::vector<FileReport>& reports) {
+    std::ostringstream text;
+    char line[64];
+    text << "Startup profile\n";
+    for (const auto& phase : phases) {
+      snprintf(line, sizeof(line), "  %-8s %12s ms\n", phase.first.c_str(),
+          milliseconds(phase.second).c_str());
+      text << line;
     }
-  };
+    text << "\nSlowest files (ms)\n"
+        << "       total        read       parse       build    deps  name\n";
+    for (const FileReport* report : slowest(reports)) {
+      text << std::setw(12) << milliseconds(report->total())
+          << std::setw(12) << milliseconds(report->times.read)
+          << std::setw(12) << milliseconds(report->times.parse)
+          << std::setw(12) << milliseconds(report->times.build)
+          << std::setw(8) << report->transitive_dependencies
+          << "  " << report->name << (report->times.cached ? " (cached)" : "") << "\n";
+    }
+    text << "\nMost imported files\n"
+        << "   importers  transitive  name\n";
+    for (const FileReport* report : mostImported(reports)) {
+      text << std::setw(12) << report->importers
+          << std::setw(12) << report->transitive_importers
+          << "  " << report->name << "\n";
+    }
+    return text.str();
+  }
+};
 
-  virtual CDKOBJS* getCDKActiveObject() {
-    return cur_object;
+/**
+ * Parses proto files into FileDescriptorProtos on a pool of worker threads.
+ * Imports are followed, so that the output contains every file needed to build
+ * the requested files. Building descriptors is left to the caller, because a
+ * DescriptorPool can only be built serially.
+ */
+class ParallelProtoParser {
+public:
+  /**
+   * Constructor. Errors are forwarded to error_collector, which will only be
+   * invoked by one thread at a time.
+   */
+  ParallelProtoParser(
+      const std::vector<const char*>& proto_paths,
+      int jobs,
+      MultiFileErrorCollector* error_collector)
+      : proto_paths(proto_paths)
+      , jobs(jobs)
+      , error_collector(error_collector)
+      , cache(NULL)
+      , profile(NULL)
+      , keep_source_info(true)
+      , queued(0)
+      , parsed_count(0)
+      , had_errors(false) {}
+
+  /**
+   * Serve unchanged files from cache instead of parsing them, and record the
+   * stamps of the files that are parsed.
+   */
+  void setCache(ProtoCache* cache) {
+    this->cache = cache;
   }
-private:
+
   /**
-   * The screen used for drawing CDK objects.
+   * Stop parsing once *stop becomes true. parse() then returns the files that
+   * were parsed so far.
    */
-  CDKSCREEN* cdk_screen;
+  void setStopFlag(const std::atomic<bool>* stop) {
+    queue.setStopFlag(stop);
+  }
 
   /**
-   * The window on the right used for displaying the JSON representation of the
-   * constructed proto.
+   * Record the time spent reading and parsing each file in profile.
    */
-  CDKSWINDOW* json_display;
+  void setProfile(StartupProfile* profile) {
+    this->profile = profile;
+  }
 
   /**
-   * The set of fields associated with the top-level fields of the message we are constructing.
+   * Whether to keep the comments and source locations of parsed files, which
+   * are only needed to show definitions and take up a large part of each
+   * file. Defaults to true.
    */
-  std::vector<ProtoCDKField*> root_proto_cdk_fields;
+  void setKeepSourceInfo(bool keep_source_info) {
+    this->keep_source_info = keep_source_info;
+  }
 
   /**
-   * The set of all fields that are currently on the screen, including buttons.
+   * Treat filename as already parsed, so that it is not parsed when another
+   * file imports it.
    */
-  std::vector<ProtoCDKField*> proto_cdk_fields;
+  void skip(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(mutex);
+    seen.insert(filename);
+    started.insert(filename);
+  }
 
   /**
-   * The index of the current object in proto_cdk_fields.
+   * Call progress as files are parsed, with the files parsed since the last
+   * call, the number of files parsed so far and the number of files queued
+   * for parsing in total. Calls are made from the worker threads, one at a
+   * time, without holding up the other workers: files parsed while a call is
+   * running are passed to the next one. The last call is made before parse()
+   * returns.
    */
-  int index;
+  void setProgress(std::function<void(const FileMap&, int, int)> progress) {
+    this->progress = progress;
+  }
 
   /**
-   * The currently focused object, which will receive events.
+   * Parse the given files and every file they import, adding the results to
+   * files. Returns false if any file could not be found or parsed.
    */
-  CDKOBJS *cur_object;
+  bool parse(const std::vector<std::string>& filenames, FileMap* files) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (const std::string& filename : filenames) {
+      enqueue(filename);
+    }
+    lock.unlock();
+
+    // Each worker has its own source tree, because DiskSourceTree records the
+    // last error in a member and is therefore not thread-safe.
+    std::vector<DiskSourceTree> source_trees(jobs);
+    for (DiskSourceTree& source_tree : source_trees) {
+      for (const char* proto_path : proto_paths) {
+        source_tree.MapPath("", proto_path);
+      }
+    }
+    queue.run(jobs, [this, &source_trees](std::string& filename, int worker) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!started.insert(filename).second) {
+        return;
+      }
+      lock.unlock();
+      std::unique_ptr<FileDescriptorProto> file = parseFile(&source_trees[worker], filename);
+      lock.lock();
+      if (file) {
+        // Parse imports before the remaining files, so that files become
+        // usable together with their imports while parsing is in progress.
+        for (const std::string& dependency : file->dependency()) {
+          enqueue(dependency, true);
+        }
+        std::shared_ptr<const FileDescriptorProto>& parsed_file = parsed[filename];
+        parsed_file.reset(file.release());
+        parsed_count++;
+        if (progress) {
+          unreported[filename] = parsed_file;
+          lock.unlock();
+          reportProgress(false);
+        }
+      } else {
+        had_errors = true;
+      }
+    });
+    if (progress) {
+      reportProgress(true);
+    }
 
+    for (const auto& name_and_file : parsed) {
+      (*files)[name_and_file.first] = name_and_file.second;
+    }
+    parsed.clear();
+    return !had_errors;
+  }
+
+private:
   /**
-   * The minimum row of the virtual display to render, for scrolling.
+   * Adapts the per-file error reporting of the tokenizer and parser to the
+   * shared MultiFileErrorCollector.
    */
-  int min_row_to_display;
+  class FileErrorCollector : public google::protobuf::io::ErrorCollector {
+  public:
+    FileErrorCollector(ParallelProtoParser* owner, const std::string& filename)
+        : had_errors(false), owner(owner), filename(filename) {}
+
+    virtual void AddError(int line, int column, const std::string& message) {
+      had_errors = true;
+      owner->reportError(filename, line, column, message);
+    }
+
+    bool had_errors;
+
+  private:
+    ParallelProtoParser* owner;
+    const std::string& filename;
+  };
 
   /**
-   * The maximum row of the virtual display to rende, for scrolling.
+   * The directories to resolve proto files against, in priority order.
    */
-  int max_row_to_display;
+  const std::vector<const char*>& proto_paths;
 
   /**
-   * The window where help text will be drawn.
+   * The number of worker threads to parse with.
    */
-  CDKSWINDOW* help_window;
+  int jobs;
 
   /**
-   * The descriptor of the Rpc method we are constructing a request for.
+   * Where parse errors are reported. Guarded by error_mutex.
    */
-  const MethodDescriptor* method_descriptor;
+  MultiFileErrorCollector* error_collector;
+  std::mutex error_mutex;
 
   /**
-   * The message descriptor of the input type of the method_descriptor.
+   * The cache of previously parsed files, or NULL when caching is disabled.
    */
-  const Descriptor* input_descriptor;
+  ProtoCache* cache;
 
   /**
-   * The command line options passed into the program.
+   * Where timings are recorded, or NULL when not profiling.
    */
-  const Options& options;
+  StartupProfile* profile;
+
+  bool keep_source_info;
 
   /**
-   * Add the given field descriptor to the given position in the display.
+   * Files that are waiting to be parsed.
    */
-  ProtoCDKField* addDescriptorToDisplay(
-      const FieldDescriptor* field_descriptor,
-      int tab_index,
-      int insert_before,
-      int child_of_repeated = 0) {
-    static const size_t field_label_length = 1024;
-    char* field_name =  strdup(field_descriptor->name().c_str());
-    FieldDescriptor::Type field_type = field_descriptor->type();
-    ProtoCDKField* proto_cdk_field = new ProtoCDKField();
-    proto_cdk_field->field_descriptor = field_descriptor;
-    proto_cdk_field->field_label_string = new char[field_label_length];
-    proto_cdk_field->field_cdk_label = NULL;
-    proto_cdk_field->field_cdk_obj = NULL;
-    proto_cdk_field->hide_expand = 0;
-    proto_cdk_field->field_cached_value = NULL;
+  WorkQueue<std::string> queue;
 
-    if (field_descriptor->is_repeated() && !child_of_repeated) {
-      proto_cdk_field->field_cdk_type = ADD_BUTTON;
-    } else {
-      if (field_type != FieldDescriptor::Type::TYPE_MESSAGE) {
-        proto_cdk_field->field_cdk_type = ENTRY;
-      } else {
-        proto_cdk_field->field_cdk_type = EXPAND_BUTTON;
-      }
-    }
+  /**
+   * Guards all of the members below.
+   */
+  std::mutex mutex;
 
-    char* label = proto_cdk_field->field_label_string;
-    if (field_type == FieldDescriptor::Type::TYPE_ENUM) {
-      snprintf(label, field_label_length, "%s %s:",
-          field_descriptor->enum_type()->full_name().c_str(), field_name);
-      if (strlen(label) > num_cols / 2 - 6) {
-        snprintf(label, field_label_length, "%s %s:",
-            field_descriptor->enum_type()->name().c_str(), field_name);
-      }
-    } else if (field_type == FieldDescriptor::Type::TYPE_MESSAGE) {
-      snprintf(label, field_label_length, "%s %s:", field_descriptor->message_type()->full_name().c_str(), field_name);
-      // Label is too long, truncate it.
-      if (strlen(label) > num_cols / 2 - 6) {
-        snprintf(label, field_label_length, "%s %s:",
-            field_descriptor->message_type()->name().c_str(), field_name);
-      }
-    } else {
-      snprintf(label, field_label_length, "%s %s:", field_descriptor->type_name(), field_name);
-    }
+  /**
+   * Files that have been queued, so that every file is parsed exactly once.
+   */
+  std::unordered_set<std::string> seen;
 
-    proto_cdk_field->field_descriptor = field_descriptor;
-    proto_cdk_field->tab_index = tab_index;
-    proto_cdk_fields.insert(proto_cdk_fields.begin() + insert_before, proto_cdk_field);
+  /**
+   * Files that a worker has picked up. An import that is still waiting in the
+   * queue is queued again at the front, so the later copy must be skipped.
+   */
+  std::unordered_set<std::string> started;
 
-    free(field_name);
-    return proto_cdk_field;
-  }
+  /**
+   * The number of files that have been queued.
+   */
+  int queued;
 
-  void redrawProtoCdkFields(int insert_before) {
-    // Erase before creating, to avoid erasing after creating.
-    for (int i = insert_before; i < proto_cdk_fields.size(); i++) {
-      ProtoCDKField* proto_cdk_field = proto_cdk_fields[i];
+  /**
+   * The successfully parsed files.
+   */
+  FileMap parsed;
 
-      // Handle the special buttons without labels first
-      if (proto_cdk_field->field_cdk_type == REQUEST_BUTTON) {
-        if (proto_cdk_field->field_cdk_obj != NULL) {
-          destroyCDKObject((CDKBUTTON*)proto_cdk_field->field_cdk_obj);
-          proto_cdk_field->field_cdk_obj = NULL;
-        }
-        continue;
-      } else if (proto_cdk_field->field_cdk_type == EXPORT_BUTTON) {
-        if (proto_cdk_field->field_cdk_obj != NULL) {
-          destroyCDKObject((CDKBUTTON*)proto_cdk_field->field_cdk_obj);
-          proto_cdk_field->field_cdk_obj = NULL;
-        }
-        continue;
-      }
+  /**
+   * The number of files in parsed.
+   */
+  int parsed_count;
 
-      if (proto_cdk_field->field_cdk_label != NULL) {
-        destroyCDKObject((CDKLABEL*)proto_cdk_field->field_cdk_label);
-        proto_cdk_field->field_cdk_label = NULL;
-      }
-      if (proto_cdk_field->field_cdk_type == ENTRY) {
-        if (proto_cdk_field->field_cdk_obj != NULL) {
-          proto_cdk_field->field_cached_value =
-              strdup(((CDKENTRY*)proto_cdk_field->field_cdk_obj)->info);
-          destroyCDKObject((CDKENTRY*)proto_cdk_field->field_cdk_obj);
-          proto_cdk_field->field_cdk_obj = NULL;
-        }
-      } else if (proto_cdk_field->field_cdk_type == EXPAND_BUTTON) {
-        if (proto_cdk_field->field_cdk_obj != NULL) {
-          destroyCDKObject((CDKBUTTON*)proto_cdk_field->field_cdk_obj);
-          proto_cdk_field->field_cdk_obj = NULL;
-        }
-      } else if (proto_cdk_field->field_cdk_type == ADD_BUTTON) {
-        if (proto_cdk_field->field_cdk_obj != NULL) {
-          destroyCDKObject((CDKBUTTON*)proto_cdk_field->field_cdk_obj);
-          proto_cdk_field->field_cdk_obj = NULL;
-        }
-      }
-    }
+  /**
+   * The parsed files that have not been passed to progress yet.
+   */
+  FileMap unreported;
 
-    // Create and draw, since moving is not working in CDK
-    for (int i = insert_before; i < proto_cdk_fields.size(); i++) {
-      ProtoCDKField* proto_cdk_field = proto_cdk_fields[i];
-
-      // Handle the special buttons without labels first
-      if (proto_cdk_field->field_cdk_type == REQUEST_BUTTON) {
-        proto_cdk_field->field_virtual_row = proto_cdk_fields.size();
-        CDKBUTTON* request_button =
-            newCDKButton(cdk_screen, LEFT, proto_cdk_field->field_virtual_row - min_row_to_display,
-                "Make Request",[](struct SButton *button){}, 0, 0);
-        proto_cdk_field->field_cdk_obj = (CDKOBJS*) request_button;
-        if (proto_cdk_field->field_virtual_row >= min_row_to_display && proto_cdk_field->field_virtual_row <= max_row_to_display) {
-          drawCDKButton(request_button, 0);
-          unsetFocus(proto_cdk_field->field_cdk_obj);
-        }
-        continue;
-      } else if (proto_cdk_field->field_cdk_type == EXPORT_BUTTON) {
-        proto_cdk_field->field_virtual_row = proto_cdk_fields.size();
-        CDKBUTTON* export_button =
-            newCDKButton(cdk_screen, strlen("Make Request") + 2, proto_cdk_field->field_virtual_row - min_row_to_display,
-                "Export Script",[](struct SButton *button){}, 0, 0);
-        proto_cdk_field->field_cdk_obj = (CDKOBJS*) export_button;
-        if (proto_cdk_field->field_virtual_row >= min_row_to_display && proto_cdk_field->field_virtual_row <= max_row_to_display) {
-          drawCDKButton(export_button, 0);
-          unsetFocus(proto_cdk_field->field_cdk_obj);
-        }
-        continue;
-      }
+  /**
+   * Called whenever a file has been parsed, if set.
+   */
+  std::function<void(const FileMap&, int, int)> progress;
 
+  /**
+   * Held while progress runs, so that calls are made one at a time.
+   */
+  std::mutex progress_mutex;
 
-      int xpos = 2 * proto_cdk_field->tab_index;
-      proto_cdk_field->field_virtual_row = i;
-      int ypos = i - min_row_to_display;
-      if (ypos < 0) ypos = 0;
-      proto_cdk_field->field_cdk_label =
-          newCDKLabel(cdk_screen, xpos, ypos, &proto_cdk_field->field_label_string, 1, 0, 0);
-      if (proto_cdk_field->field_virtual_row >= min_row_to_display &&
-          proto_cdk_field->field_virtual_row <= max_row_to_display) {
-        drawCDKLabel(proto_cdk_field->field_cdk_label, 0);
-      }
-      xpos += strlen(proto_cdk_field->field_label_string) + 1;
-      int width = num_cols / 2 - xpos - 1;
-      if (proto_cdk_field->field_cdk_type == ENTRY) {
-        CDKENTRY* entry = newCDKEntry (cdk_screen,
-            xpos, ypos,
-            /*title=*/"", /*label=*/"", A_NORMAL, '_', vMIXED,
-            width, 0, 256,
-            FALSE, FALSE);
-        // The use of this cached value is unfortunate, but necessary because
-        // the move APIs for CDK seem to be noops, as far as hqin can tell.
-        if (proto_cdk_field->field_cached_value != NULL) {
-          setCDKEntryValue(entry, proto_cdk_field->field_cached_value);
-          free(proto_cdk_field->field_cached_value);
-          proto_cdk_field->field_cached_value= NULL;
-        }
-        if (proto_cdk_field->field_virtual_row >= min_row_to_display &&
-            proto_cdk_field->field_virtual_row <= max_row_to_display) {
-          drawCDKEntry(entry, 1);
-        }
-        proto_cdk_field->field_cdk_obj = (CDKOBJS*) entry;
-      } else if (proto_cdk_field->field_cdk_type == EXPAND_BUTTON) {
-        if (!proto_cdk_field->hide_expand) {
-          CDKBUTTON* button = newCDKButton(cdk_screen, xpos, ypos, "Expand",[](struct SButton *button){}, 0, 0);
-          if (proto_cdk_field->field_virtual_row >= min_row_to_display &&
-              proto_cdk_field->field_virtual_row <= max_row_to_display) {
-            drawCDKButton(button, 0);
-          }
-          proto_cdk_field->field_cdk_obj = (CDKOBJS*) button;
-        }
-      } else if (proto_cdk_field->field_cdk_type == ADD_BUTTON) {
-        CDKBUTTON* button = newCDKButton(cdk_screen, xpos, ypos, "Add",[](struct SButton *button){}, 0, 0);
-        if (proto_cdk_field->field_virtual_row >= min_row_to_display &&
-            proto_cdk_field->field_virtual_row <= max_row_to_display) {
-          drawCDKButton(button, 0);
-        }
-        proto_cdk_field->field_cdk_obj = (CDKOBJS*) button;
-      }
-      if (proto_cdk_field->field_cdk_obj) {
-        if (proto_cdk_field->field_virtual_row >= min_row_to_display &&
-            proto_cdk_field->field_virtual_row <= max_row_to_display) {
-          unsetFocus(proto_cdk_field->field_cdk_obj);
-        }
-      }
+  /**
+   * True if any file failed to parse.
+   */
+  bool had_errors;
+
+  /**
+   * Queue a file for parsing unless it was queued before. An urgent file that
+   * is still waiting is moved to the front. Requires mutex.
+   */
+  void enqueue(const std::string& filename, bool urgent = false) {
+    bool first = seen.insert(filename).second;
+    if (first) {
+      queued++;
+    }
+    if (urgent && !started.count(filename)) {
+      queue.pushFront(filename);
+    } else if (first) {
+      queue.push(filename);
     }
   }
 
   /**
-   * Parse the current proto values and redraw the JSON display on the right.
+   * Pass the unreported files to progress, outside of mutex so that the other
+   * workers keep parsing meanwhile. Unless wait is true, nothing is done if
+   * another call is already running, since it will be followed by the next
+   * file's.
    */
-  void updateJsonDisplay() {
-    std::string json_message = getJsonMessage(input_descriptor, root_proto_cdk_fields);
-    showMultilineMessage(json_display, json_message);
-    unsetFocus((CDKOBJS*)json_display);
+  void reportProgress(bool wait) {
+    std::unique_lock<std::mutex> progress_lock(progress_mutex, std::defer_lock);
+    if (wait) {
+      progress_lock.lock();
+    } else if (!progress_lock.try_lock()) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (unreported.empty()) {
+      return;
+    }
+    FileMap newly_parsed;
+    newly_parsed.swap(unreported);
+    int parsed_so_far = parsed_count;
+    int queued_so_far = queued;
+    lock.unlock();
+    progress(newly_parsed, parsed_so_far, queued_so_far);
+  }
+
+  void reportError(const std::string& filename, int line, int column,
+      const std::string& message) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    error_collector->AddError(filename, line, column, message);
   }
 
   /**
-   * Change the focus to the previous item in proto_cdk_fields.
+   * Read, tokenize and parse a single file, unless the cache has an up to date
+   * parse of it. Returns NULL on failure.
    */
-  void focusPrevious() {
-    if (cur_object) {
-      unsetFocus(cur_object);
+  std::unique_ptr<FileDescriptorProto> parseFile(DiskSourceTree* source_tree,
+      const std::string& filename) {
+    auto start_time = std::chrono::steady_clock::now();
+    std::unique_ptr<FileDescriptorProto> file(new FileDescriptorProto());
+    FileStamp stamp;
+    bool stamped = false;
+    if (cache != NULL) {
+      if (cache->lookup(filename, file.get())) {
+        if (profile != NULL) {
+          std::chrono::duration<double> read_time = std::chrono::steady_clock::now() - start_time;
+          profile->recordParse(filename, read_time.count(), 0, true);
+        }
+        return file;
+      }
+      // Stamp before reading, so that a concurrent edit makes the recorded
+      // stamp stale rather than the cached contents.
+      stamped = stampProtoFile(proto_paths, filename, &stamp);
     }
-    if (index == 0) {
-      index = proto_cdk_fields.size() - 1;
-    } else {
-      index--;
-      index %= proto_cdk_fields.size();
+
+    std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> input(
+        source_tree->Open(filename));
+    if (input == NULL) {
+      reportError(filename, -1, 0, source_tree->GetLastErrorMessage());
+      return NULL;
     }
-    // Scrolling
-    bool scrolled = false;
-    while (proto_cdk_fields[index]->field_virtual_row < min_row_to_display) {
-      scrolled = true;
-      max_row_to_display--;
-      min_row_to_display--;
+    // Read the whole file up front, so that reading and parsing can be timed
+    // separately. Proto files are small enough for this to cost nothing.
+    std::string contents;
+    const void* data;
+    int size;
+    while (input->Next(&data, &size)) {
+      contents.append((const char*) data, size);
     }
-    while (proto_cdk_fields[index]->field_virtual_row > max_row_to_display) {
-      scrolled = true;
-      max_row_to_display++;
-      min_row_to_display++;
+    input.reset();
+    auto read_time = std::chrono::steady_clock::now();
+
+    FileErrorCollector file_error_collector(this, filename);
+    google::protobuf::io::ArrayInputStream contents_input(contents.data(), contents.size());
+    google::protobuf::io::Tokenizer tokenizer(&contents_input, &file_error_collector);
+    Parser parser;
+    parser.RecordErrorsTo(&file_error_collector);
+
+    file->set_name(filename);
+    if (!parser.Parse(&tokenizer, file.get()) || file_error_collector.had_errors) {
+      return NULL;
     }
-    if (scrolled) {
-      redraw();
-      cur_object = proto_cdk_fields[index]->field_cdk_obj;
+    if (!keep_source_info) {
+      file->clear_source_code_info();
     }
-    // End scrolling
-
-    if (proto_cdk_fields[index]->hide_expand) {
-      focusPrevious();
-    } else {
-      cur_object = setCDKFocusCurrent(cdk_screen, proto_cdk_fields[index]->field_cdk_obj);
-      setFocus(cur_object);
+    if (profile != NULL) {
+      std::chrono::duration<double> read_seconds = read_time - start_time;
+      std::chrono::duration<double> parse_seconds = std::chrono::steady_clock::now() - read_time;
+      profile->recordParse(filename, read_seconds.count(), parse_seconds.count(), false);
     }
+    if (stamped) {
+      cache->record(filename, stamp);
+    }
+    return file;
   }
+};
+
+/**
+ * What the background threads that load protos have to tell the interface.
+ */
+struct ProtoUpdate {
+  ProtoUpdate() : fatal(false) {}
 
   /**
-   * Change the focus to the next item in proto_cdk_fields.
+   * The newest generation, or NULL if there is no new one.
    */
-  void focusNext() {
-    debugMsg("focusNext: cur_object = %p\n", cur_object);
-    // If there was a scrolling event and the currently focused object is an
-    // already-expanded EXPAND button (which can happen on a recursive call
-    // after a scrolling event), then cur_object will be NULL.
-    if (cur_object) {
-      unsetFocus(cur_object);
-    }
+  std::shared_ptr<ProtoGeneration> generation;
 
-    debugMsg("focusNext: indexBefore = %d\n", index);
-    index++;
-    index %= proto_cdk_fields.size();
-    debugMsg("focusNext: indexAfter = %d\n", index);
-
-    // Scrolling
-    bool scrolled = false;
-    while (proto_cdk_fields[index]->field_virtual_row > max_row_to_display) {
-      scrolled = true;
-      max_row_to_display++;
-      min_row_to_display++;
-    }
-    while (proto_cdk_fields[index]->field_virtual_row < min_row_to_display) {
-      scrolled = true;
-      max_row_to_display--;
-      min_row_to_display--;
-    }
-    debugMsg("focusNext: field_virtual_row = %d\n", proto_cdk_fields[index]->field_virtual_row);
-    debugMsg("focusNext: max_row_to_display = %d\n", max_row_to_display);
-    debugMsg("focusNext: min_row_to_display = %d\n", min_row_to_display);
-    if (scrolled) {
-      redraw();
-      cur_object = proto_cdk_fields[index]->field_cdk_obj;
+  /**
+   * Problems to show to the user, such as the reason the last reload failed.
+   */
+  std::string errors;
+
+  /**
+   * What is being loaded right now, or empty if nothing is.
+   */
+  std::string status;
+
+  /**
+   * True if loading failed and the program cannot continue, because of
+   * errors.
+   */
+  bool fatal;
+};
+
+/**
+ * Hands generations and loading status from background threads to the
+ * interface. All methods are thread-safe.
+ */
+class ProtoUpdates {
+public:
+  ProtoUpdates() : has_update(false), finished(false) {}
+
+  /**
+   * Hand over a new generation, if not NULL, and replace the errors.
+   */
+  void publish(std::shared_ptr<ProtoGeneration> generation, const std::string& errors) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (generation) {
+      pending.generation = generation;
     }
-    debugMsg("focusNext: Finished redraw\n");
-    // End scrolling
+    pending.errors = errors;
+    has_update = true;
+  }
 
-    if (proto_cdk_fields[index]->hide_expand) {
-      debugMsg("focusNext: recursing\n");
-      focusNext();
-    } else {
-      cur_object = setCDKFocusCurrent(cdk_screen, proto_cdk_fields[index]->field_cdk_obj);
-      setFocus(cur_object);
+  void setStatus(const std::string& status) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending.status != status) {
+      pending.status = status;
+      has_update = true;
     }
   }
 
   /**
-   * Helper function for creating the help section of this page.
+   * Report that loading failed and the program cannot continue.
    */
-  void createHelpWindow() {
-    help_window = newCDKSwindow(cdk_screen, LEFT, num_rows - 5, 4, num_cols, "USAGE", 5, 0, 0);
-    if (help_window == 0) {
-      debugMsg("Failed to create help window. Perhaps screen was too small.\n");
-      return;
+  void abort(const std::string& errors) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.errors = errors;
+    pending.fatal = true;
+    has_update = true;
+    finished = true;
+  }
+
+  /**
+   * Report that nothing will be published anymore.
+   */
+  void finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+  }
+
+  /**
+   * True if there is nothing to take and never will be, so the interface can
+   * stop checking.
+   */
+  bool idle() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return finished && !has_update;
+  }
+
+  /**
+   * If anything changed since the last call, return true and set update.
+   */
+  bool take(ProtoUpdate* update) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!has_update) {
+      return false;
     }
-    std::string help_text =
-      "TAB/SHIFT-TAB Move cursor  \tENTER Execute action"
-      "\nF1 View proto definition \tESC Back"
-      "\nF7 Return to search";
-    showMultilineMessage(help_window, help_text);
-    drawCDKSwindow(help_window, 0);
+    *update = pending;
+    pending.generation.reset();
+    pending.errors.clear();
+    has_update = false;
+    return true;
   }
 
+private:
+  std::mutex mutex;
+  ProtoUpdate pending;
+  bool has_update;
+  bool finished;
 };
+
 /**
- * A page where users can search for and select Rpcs.
+ * Loads proto files into generations. The parsed files are kept after the
+ * initial load, so that a reload only has to parse the files that changed.
+ * Generations and progress are reported to updates.
  */
-class RpcSearchPage : public UserFacingPage {
+class ProtoLoader {
 public:
+  ProtoLoader(const Options& options, ProtoUpdates* updates)
+      : options(options), updates(updates), profile(NULL), stop(NULL) {}
+
   /**
-   * Constructor.
-   *
-   * Note that the program cannot continue if this constructor fails, it will
-   * simply crash the program rather than throwing an exception in the case of
-   * failure.
+   * Record timings of the initial load in profile.
    */
-  RpcSearchPage(
-      std::vector<UserFacingPage*>& page_stack,
-      const std::map<std::string, const MethodDescriptor*>& method_descriptors,
-      const Options& options) :
-    page_stack(page_stack),
-    method_descriptors(method_descriptors),
-    options(options) {
-
+  void setProfile(StartupProfile* profile) {
+    this->profile = profile;
+  }
 
-    cdk_screen = initCDKScreen (NULL);
-    initCDKColor ();
+  /**
+   * Give up the initial load once *stop becomes true, such as when the
+   * program exits before loading finishes.
+   */
+  void setStopFlag(const std::atomic<bool>* stop) {
+    this->stop = stop;
+  }
 
-    createHelpWindow();
-    createSearchEntryOrDie();
-    selection = NULL;
-    items = NULL;
+  /**
+   * Parse a few root files that are likely to be used, and their imports, and
+   * publish a generation with their methods before the proto paths have even
+   * been searched. Unchanged files are served from the cache, and load() then
+   * keeps these files instead of parsing them again. Files that fail to parse
+   * are left out rather than reported, since load() reports them.
+   */
+  void loadFirst(const std::vector<std::string>& filenames) {
+    std::string errors;
+    StringErrorCollector error_collector(&errors);
+    ParallelProtoParser parser(options.protoPaths, options.jobs, &error_collector);
+    parser.setKeepSourceInfo(!options.lazy_comments);
+    parser.setCache(openCache());
+    parser.setStopFlag(stop);
+    parser.parse(filenames, &files);
+    if (stopped()) {
+      return;
+    }
+    updates->publish(partialGeneration(files,
+        std::set<std::string>(filenames.begin(), filenames.end())), "");
   }
 
   /**
-   * Destructor.
+   * Load the given root files and their imports and build the first
+   * generation. Files in the descriptor sets of the options are used as they
+   * are, and every other file is parsed. Without root files, every file in the
+   * descriptor sets is a root. Generations with the methods found so far are
+   * published while parsing, so that they can be searched for before loading
+   * finishes. Returns false and aborts updates on errors, since there is
+   * nothing to show without the protos, and returns false without publishing
+   * anything when stopped.
    */
-  ~RpcSearchPage() {
-    if (items != NULL) {
-      delete[] items;
+  bool load(const std::vector<std::string>& filenames) {
+    std::string errors;
+    StringErrorCollector error_collector(&errors);
+
+    for (const std::string& path : options.descriptor_sets) {
+      updates->setStatus("Reading " + path + "...");
+      if (!readDescriptorSet(path, &errors)) {
+        updates->abort(errors + "Encoutered errors while reading descriptor sets. Aborting...\n");
+        return false;
+      }
+    }
+    std::set<std::string> roots(filenames.begin(), filenames.end());
+    if (roots.empty()) {
+      for (const auto& name_and_file : files) {
+        roots.insert(name_and_file.first);
+      }
+    }
+    std::vector<std::string> to_parse;
+    for (const std::string& root : roots) {
+      if (!files.count(root)) {
+        to_parse.push_back(root);
+      }
+    }
+    for (const auto& name_and_file : files) {
+      for (const std::string& dependency : name_and_file.second->dependency()) {
+        if (!files.count(dependency)) {
+          to_parse.push_back(dependency);
+        }
+      }
     }
-    destroyCDKEntry(search_term_entry);
-    search_term_entry = NULL;
 
-    if (selection != NULL) {
-      destroyCDKSelection(selection);
-      selection = NULL;
+    // Parse every file and its imports in parallel, since parsing is by far the
+    // most expensive part of loading. Unchanged files are served from the cache
+    // of the previous run.
+    auto parse_start_time = std::chrono::steady_clock::now();
+    ParallelProtoParser parser(options.protoPaths, options.jobs, &error_collector);
+    parser.setKeepSourceInfo(!options.lazy_comments);
+    parser.setProfile(profile);
+    parser.setCache(openCache());
+    parser.setStopFlag(stop);
+    for (const auto& name_and_file : files) {
+      parser.skip(name_and_file.first);
     }
-    if (help_window != NULL ) {
-      destroyCDKSwindow(help_window);
+
+    // Publish partial generations with exponential backoff, so that creating
+    // them stays a small part of loading no matter how many files there are.
+    std::chrono::milliseconds interval(100);
+    auto next_publish = std::chrono::steady_clock::now() + interval;
+    FileMap loaded = files;
+    parser.setProgress([&](const FileMap& newly_parsed, int parsed_count, int queued) {
+      loaded.insert(newly_parsed.begin(), newly_parsed.end());
+      updates->setStatus("Loading " + std::to_string(files.size() + parsed_count) +
+          "/" + std::to_string(files.size() + queued) + " proto files...");
+      auto now = std::chrono::steady_clock::now();
+      if (now >= next_publish) {
+        updates->publish(partialGeneration(loaded, roots), "");
+        interval *= 2;
+        next_publish = now + interval;
+      }
+    });
+    bool parsed = parser.parse(to_parse, &files);
+    if (stopped()) {
+      return false;
     }
-    destroyCDKScreen (cdk_screen);
+    if (!parsed) {
+      updates->abort(errors + "Encoutered errors while parsing proto files. Aborting...\n");
+      return false;
+    }
+    if (cache) {
+      cache->save(files);
+      cache.reset();
+    }
+    root_filenames = roots;
+    auto build_start_time = std::chrono::steady_clock::now();
+
+    // Build all the roots unless in lazy mode.
+    std::shared_ptr<ProtoGeneration> generation =
+        buildGeneration(options.lazy ? std::set<std::string>() : root_filenames, &errors);
+    if (!generation) {
+      updates->abort(errors + "Encoutered errors causing a full FD on import. Aborting...\n");
+      return false;
+    }
+    if (profile != NULL) {
+      std::chrono::duration<double> parse_time = build_start_time - parse_start_time;
+      std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - build_start_time;
+      profile->recordPhase("parse", parse_time.count());
+      profile->recordPhase("build", build_time.count());
+      profile = NULL;
+    }
+    updates->publish(generation, "");
+    generation->indexTypes();
+    return true;
   }
 
-  virtual bool handleInput(int key_code, int function_key) {
-    switch (key_code) {
-      case KEY_ESC:
-        break;
-      case KEY_BTAB:
-      case KEY_TAB:
-        if (cur_object == (CDKOBJS*) search_term_entry) {
-          processSearch();
-        } else {
-          destroyCDKSelection(selection);
-          selection = NULL;
-          delete[] items;
-          items = NULL;
-          // Switch back to search_term_entry
-          cur_object = (CDKOBJS*) search_term_entry;
-          setFocus(cur_object);
-          setCDKFocusCurrent(cdk_screen, cur_object);
-        }
-        break;
-      case 153: // Alt-H
-      case KEY_F1:
-        if (cur_object != (CDKOBJS*) search_term_entry) {
-          int selected_index = getCDKSelectionCurrent(selection);
-          const MethodDescriptor* method_descriptor = found_descriptors[selected_index];
-          DebugStringOptions options;
-          options.include_comments = true;
-          std::string debugString;
-          debugString += method_descriptor->file()->name();
-          debugString += "\n";
-          debugString += method_descriptor->full_name();
-          debugString += "\n";
-          debugString += method_descriptor->DebugStringWithOptions(options);
-          debugString += "\n";
+  const FileMap& getFiles() const {
+    return files;
+  }
 
-          debugString += method_descriptor->input_type()->file()->name();
-          debugString += "\n";
-          debugString += method_descriptor->input_type()->full_name();
-          debugString += "\n";
-          debugString += method_descriptor->input_type()->DebugStringWithOptions(options);
-          debugString += "\n";
+  /**
+   * Re-parse the files in changed, which may have been modified, created or
+   * deleted, and build a new generation. Only the root files affected by the
+   * change are built right away, or just the changed ones in lazy mode; the
+   * rest are built on first use. Returns NULL if nothing needed reloading, or
+   * if the change does not parse or build, in which case errors says why and
+   * the current generation should be kept.
+   */
+  std::shared_ptr<ProtoGeneration> reload(const std::set<std::string>& changed_files,
+      std::string* errors) {
+    StringErrorCollector error_collector(errors);
+    // Files given on the command line are the only roots, so other files only
+    // matter if they are already imported. Files that failed last time are
+    // retried, since the change may have been a missing import appearing.
+    bool walked = options.protoFiles.empty();
+    std::set<std::string> changed;
+    changed.swap(failed);
+    for (const std::string& filename : changed_files) {
+      if (walked || files.count(filename)) {
+        changed.insert(filename);
+      }
+    }
+    if (changed.empty()) {
+      return NULL;
+    }
 
-          debugString += method_descriptor->output_type()->file()->name();
-          debugString += "\n";
-          debugString += method_descriptor->output_type()->full_name();
-          debugString += "\n";
-          debugString += method_descriptor->output_type()->DebugStringWithOptions(options);
-          showInfoPanel(cdk_screen, debugString);
+    std::vector<std::string> modified;
+    std::vector<std::string> deleted;
+    for (const std::string& filename : changed) {
+      FileStamp stamp;
+      if (stampProtoFile(options.protoPaths, filename, &stamp)) {
+        modified.push_back(filename);
+      } else {
+        deleted.push_back(filename);
+      }
+    }
 
-          // Switch back to search_term_entry after this returns.
-          redraw();
-        }
-        break;
-      case KEY_ENTER:
-        if (cur_object == (CDKOBJS*) search_term_entry) {
-          processSearch();
-        } else {
-          int selected_index = getCDKSelectionCurrent(selection);
-          // In theory, we could support going back to this screen without recreating  it.
-          eraseCDKScreen(cdk_screen);
-          // Create the next screen and push it onto the stack.
-          RequestBuilderPage* request_builder_page =
-              new RequestBuilderPage(found_descriptors[selected_index],
-                  options);
-          page_stack.push_back(request_builder_page);
-        }
-        break;
-      case 'j':
-        if (cur_object != (CDKOBJS*) search_term_entry) {
-          InjectObj(cur_object, KEY_DOWN);
-        } else {
-          InjectObj(cur_object, key_code);
-        }
-        break;
-      case 'k':
-        if (cur_object != (CDKOBJS*) search_term_entry) {
-          InjectObj(cur_object, KEY_UP);
-        } else {
-          InjectObj(cur_object, key_code);
-        }
-        break;
-      default:
-        InjectObj(cur_object, key_code);
+    ParallelProtoParser parser(options.protoPaths, options.jobs, &error_collector);
+    parser.setKeepSourceInfo(!options.lazy_comments);
+    for (const auto& name_and_file : files) {
+      if (!changed.count(name_and_file.first)) {
+        parser.skip(name_and_file.first);
+      }
+    }
+    FileMap parsed;
+    if (!parser.parse(modified, &parsed)) {
+      failed = changed;
+      return NULL;
     }
-    return false;
-  }
 
-  virtual CDKOBJS* getCDKActiveObject() {
-    return cur_object;
-  }
+    for (const std::string& filename : deleted) {
+      files.erase(filename);
+      if (walked) {
+        root_filenames.erase(filename);
+      }
+    }
+    for (const auto& name_and_file : parsed) {
+      files[name_and_file.first] = name_and_file.second;
+    }
+    if (walked) {
+      root_filenames.insert(modified.begin(), modified.end());
+    }
 
-  virtual void redraw() {
-    // Save data and recreate cdk objects to support screen resizing.
-    bool in_selection = false;
-    int selected_index;
-    if (selection != NULL) {
-      in_selection = true;
-      selected_index = getCDKSelectionCurrent(selection);
+    // Find everything that imports a changed file, directly or not.
+    std::set<std::string> affected = changed;
+    if (!options.lazy) {
+      std::unordered_map<std::string, std::vector<std::string>> dependents;
+      for (const auto& name_and_file : files) {
+        for (const std::string& dependency : name_and_file.second->dependency()) {
+          dependents[dependency].push_back(name_and_file.first);
+        }
+      }
+      std::vector<std::string> pending(changed.begin(), changed.end());
+      while (!pending.empty()) {
+        std::string filename = pending.back();
+        pending.pop_back();
+        for (const std::string& dependent : dependents[filename]) {
+          if (affected.insert(dependent).second) {
+            pending.push_back(dependent);
+          }
+        }
+      }
     }
-    char* search_box_content = strdup(search_term_entry->info);
-
-    // Destroy CDK objects
-    destroyCDKEntry(search_term_entry);
-    if (in_selection) {
-      destroyCDKSelection(selection);
+    std::set<std::string> build_now;
+    for (const std::string& filename : affected) {
+      if (root_filenames.count(filename)) {
+        build_now.insert(filename);
+      }
     }
 
-    // Recreate CDK objects
-    createSearchEntryOrDie();
-    setCDKEntryValue(search_term_entry, search_box_content);
-    // Draw again after restoring the value.
-    drawCDKEntry(search_term_entry, 1);
-    if (in_selection) {
-      createAndFocusSelection();
-      setCDKSelectionCurrent(selection, selected_index);
-      drawCDKSelection(selection, 1);
+    std::shared_ptr<ProtoGeneration> generation = buildGeneration(build_now, errors);
+    if (!generation) {
+      failed = changed;
     }
+    return generation;
+  }
 
-    free(search_box_content);
+  /**
+   * The names of all the files that have been loaded.
+   */
+  std::vector<std::string> getFilenames() const {
+    std::vector<std::string> filenames;
+    for (const auto& name_and_file : files) {
+      filenames.push_back(name_and_file.first);
+    }
+    return filenames;
+  }
 
-    // Redraw help text.
-    if (help_window != NULL) {
-      destroyCDKSwindow(help_window);
+private:
+  /**
+   * Collects parse errors into a string, for showing in the curses interface.
+   */
+  class StringErrorCollector : public MultiFileErrorCollector {
+  public:
+    StringErrorCollector(std::string* errors) : errors(errors) {}
+
+    virtual void AddError(const std::string& filename, int line, int column,
+        const std::string& message) {
+      *errors += "Error occured for " + filename + ":" + std::to_string(line) +
+          ":" + std::to_string(column) + " " + message + "\n";
     }
-    createHelpWindow();
+
+  private:
+    std::string* errors;
   };
 
+  const Options& options;
+  ProtoUpdates* updates;
 
-private:
   /**
-   * The display page stack, used for adding pages.
+   * Where timings are recorded during the initial load, or NULL.
    */
-  std::vector<UserFacingPage*>& page_stack;
+  StartupProfile* profile;
 
   /**
-   * The screen used for drawing CDK objects.
+   * Set when the initial load should be given up, or NULL.
    */
-  CDKSCREEN* cdk_screen;
+  const std::atomic<bool>* stop;
 
   /**
-   * The field where the search entry will be entered.
+   * Every parsed file, including imports.
    */
-  CDKENTRY* search_term_entry;
+  FileMap files;
 
   /**
-   * The window displaying the list of descriptors matching the search.
+   * The cache of parsed files, shared by loadFirst() and the load() after it,
+   * or NULL when there is no cache directory or no load is in progress.
    */
-  CDKSELECTION *selection;
+  std::unique_ptr<ProtoCache> cache;
 
   /**
-   * The window where help text will be drawn.
+   * The files whose methods can be searched for.
    */
-  CDKSWINDOW* help_window;
+  std::set<std::string> root_filenames;
 
   /**
-   * The items that are part of the selection. Since the sellection does not
-   * appear to own this memory and allocates new memory instead, we must own it
-   * instead.
+   * The changed files of the last reload if it failed.
    */
-  const char** items;
+  std::set<std::string> failed;
+
+  bool stopped() const {
+    return stop != NULL && *stop;
+  }
 
   /**
-   * The currently active GUI object that is receiving input.
+   * Read the cache of parsed files the first time it is needed, so that
+   * loadFirst() and load() share it. Returns NULL without a cache directory.
    */
-  CDKOBJS* cur_object;
+  ProtoCache* openCache() {
+    if (!cache && !options.cache_dir.empty()) {
+      cache.reset(new ProtoCache(options.cache_dir, options.protoPaths,
+          !options.lazy_comments));
+      cache->load();
+    }
+    return cache.get();
+  }
 
   /**
-   * The method descriptors to search over.
+   * Add the files in a FileDescriptorSet file to files. Files that are already
+   * loaded are kept, like protoc does for files that appear in several sets.
+   * Returns false and adds to errors if the file cannot be read.
    */
-  const std::map<std::string, const MethodDescriptor*>& method_descriptors;
+  bool readDescriptorSet(const std::string& path, std::string* errors) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      *errors += "Unable to read descriptor set " + path + ": " + strerror(errno) + "\n";
+      if (fd >= 0) {
+        close(fd);
+      }
+      return false;
+    }
+    // Map the file rather than reading it, since sets with source info can be
+    // large and are only needed until they are parsed.
+    FileDescriptorSet file_set;
+    bool parsed = st.st_size == 0;
+    if (!parsed) {
+      void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        parsed = st.st_size <= INT_MAX && file_set.ParseFromArray(data, st.st_size);
+        munmap(data, st.st_size);
+      }
+    }
+    close(fd);
+    if (!parsed) {
+      *errors += "Unable to parse descriptor set " + path + ".\n";
+      return false;
+    }
+    // Release from the back, which is the cheap end of a RepeatedPtrField.
+    std::vector<std::shared_ptr<const FileDescriptorProto>> released;
+    while (file_set.file_size() > 0) {
+      FileDescriptorProto* file = file_set.mutable_file()->ReleaseLast();
+      if (options.lazy_comments) {
+        file->clear_source_code_info();
+      }
+      released.emplace_back(file);
+    }
+    for (auto it = released.rbegin(); it != released.rend(); it++) {
+      files.emplace((*it)->name(), *it);
+    }
+    return true;
+  }
 
   /**
-   * The descriptors that match the search term.
+   * Create a generation over files with a catalog entry for each method of
+   * the given root files, to be built on first use.
    */
-  std::vector<const MethodDescriptor*> found_descriptors;
+  std::shared_ptr<ProtoGeneration> newGeneration(const FileMap& files,
+      const std::set<std::string>& roots) const {
+    std::shared_ptr<ProtoGeneration> generation(new ProtoGeneration(files, options));
+    // Index the methods straight from the parsed files, since that does not
+    // require building anything.
+    for (const std::string& filename : roots) {
+      auto it = files.find(filename);
+      if (it == files.end()) {
+        continue;
+      }
+      const FileDescriptorProto& file = *it->second;
+      std::string package_prefix = file.package().empty() ? "" : file.package() + ".";
+      for (const auto& service : file.service()) {
+        for (const auto& method : service.method()) {
+          generation->catalog.add(package_prefix + service.name() + "." + method.name(),
+              filename, NULL);
+        }
+      }
+    }
+    generation->catalog.index();
+    return generation;
+  }
 
   /**
-   * The command line options passed into the program.
+   * Create a generation over the files parsed so far, with the methods of the
+   * roots whose imports have all been parsed, so that every method in it can
+   * be used.
    */
-  const Options& options;
+  std::shared_ptr<ProtoGeneration> partialGeneration(const FileMap& parsed,
+      const std::set<std::string>& roots) const {
+    std::unordered_map<std::string, bool> complete;
+    std::set<std::string> usable_roots;
+    for (const std::string& root : roots) {
+      if (isComplete(parsed, root, &complete)) {
+        usable_roots.insert(root);
+      }
+    }
+    return newGeneration(parsed, usable_roots);
+  }
 
   /**
-   * Perform actual search based on search box input and activate selection.
+   * Whether filename and everything it imports, directly or not, has been
+   * parsed. Results are memoized in complete.
    */
-  void processSearch() {
-    char *search_term = search_term_entry->info;
-    // Perform the search and populate the selection.
-    search_term = strdup(tolower(search_term).c_str());
-    std::vector<std::string> tokens = split(search_term);
-    free(search_term);
-
-    // Perform the search and populate the scrolling selection.
-    found_descriptors.clear();
-    for (auto const& method : method_descriptors) {
-      bool match = true;
-      for (auto const& token : tokens) {
-        if (method.first.find(token) == std::string::npos) {
-          match = false;
-        }
-      }
-      if (match) {
-        found_descriptors.push_back(method.second);
+  static bool isComplete(const FileMap& parsed, const std::string& filename,
+      std::unordered_map<std::string, bool>* complete) {
+    auto memo = complete->find(filename);
+    if (memo != complete->end()) {
+      return memo->second;
+    }
+    auto it = parsed.find(filename);
+    if (it == parsed.end()) {
+      (*complete)[filename] = false;
+      return false;
+    }
+    // Assume incomplete while visiting, which also ends import cycles.
+    (*complete)[filename] = false;
+    for (const std::string& dependency : it->second->dependency()) {
+      if (!isComplete(parsed, dependency, complete)) {
+        return false;
       }
     }
+    (*complete)[filename] = true;
+    return true;
+  }
 
-    // Abort early if there are no results.
-    if (found_descriptors.empty()) {
-      showInfoPanel(cdk_screen, "No results found!");
-      return;
+  /**
+   * Create a generation over the current files and build the files in
+   * build_now. Returns NULL and adds to errors if any of them fails to build.
+   */
+  std::shared_ptr<ProtoGeneration> buildGeneration(
+      const std::set<std::string>& build_now, std::string* errors) {
+    std::shared_ptr<ProtoGeneration> generation = newGeneration(files, root_filenames);
+
+    // Build imports before the files that import them, which the pool would
+    // otherwise do recursively, so that each file is built and timed on its
+    // own.
+    std::vector<std::string> order;
+    std::unordered_set<std::string> visited;
+    std::function<void(const std::string&)> visit = [&](const std::string& filename) {
+      auto it = files.find(filename);
+      if (it == files.end() || !visited.insert(filename).second) {
+        return;
+      }
+      for (const std::string& dependency : it->second->dependency()) {
+        visit(dependency);
+      }
+      order.push_back(filename);
+    };
+    for (const std::string& filename : build_now) {
+      visit(filename);
+    }
+    for (const std::string& filename : build_now) {
+      if (!visited.count(filename)) {
+        // Let the pool report the missing file.
+        order.push_back(filename);
+      }
     }
 
-    // Populate the selection
-    items = new const char*[found_descriptors.size()];
-    for (int i = 0; i < found_descriptors.size(); i++) {
-      items[i] = found_descriptors[i]->full_name().c_str();
+    // Map the full method names to MethodDescriptors, because they're all
+    // cross-linked.
+    int built = 0;
+    for (const std::string& filename : order) {
+      updates->setStatus("Building " + std::to_string(built++) + "/" +
+          std::to_string(order.size()) + " proto files...");
+      auto start_time = std::chrono::steady_clock::now();
+      const FileDescriptor* fd = generation->pool.FindFileByName(filename);
+      if (profile != NULL) {
+        std::chrono::duration<double> build_time = std::chrono::steady_clock::now() - start_time;
+        profile->recordBuild(filename, build_time.count());
+      }
+      if (fd == NULL) {
+        *errors += generation->error_collector.takeErrors();
+        if (errors->empty()) {
+          *errors = "Unable to load " + filename + ".\n";
+        }
+        updates->setStatus("");
+        return NULL;
+      }
+
+      if (!root_filenames.count(filename)) {
+        continue;
+      }
+      for (int i = 0; i < fd->service_count(); i++) {
+        const ServiceDescriptor* service = fd->service(i);
+        for (int j = 0; j < service->method_count(); j++) {
+          const MethodDescriptor* method = service->method(j);
+          generation->catalog.add(method->full_name(), filename, method);
+        }
+      }
     }
-    createAndFocusSelection();
+    updates->setStatus("");
+    generation->error_collector.takeErrors();
+    return generation;
   }
+};
 
+/**
+ * Watches the proto paths for changed proto files on a background thread, and
+ * reloads them with a ProtoLoader, which publishes the new generations.
+ * Changes are collected until the proto paths have been quiet for a moment,
+ * since editors and version control tend to write several files in quick
+ * succession. Only supported on Linux, where inotify is used.
+ */
+class ProtoWatcher {
+public:
   /**
-   * Helper function for creating the help section of this page.
+   * Constructor. The loader must not be used by anything else once start() is
+   * called.
    */
-  void createHelpWindow() {
-    help_window = newCDKSwindow(cdk_screen, LEFT, num_rows - 5, 4, num_cols, "USAGE", 5, 0, 0);
-    if (help_window == 0) {
-      debugMsg("Failed to create help window. Perhaps screen was too small.\n");
-      return;
+  ProtoWatcher(const Options& options, ProtoLoader* loader, ProtoUpdates* updates)
+      : options(options)
+      , loader(loader)
+      , updates(updates)
+      , inotify_fd(-1)
+      , stopping(false) {}
+
+  ~ProtoWatcher() {
+    stopping = true;
+    if (thread.joinable()) {
+      thread.join();
     }
-    std::string help_text =
-        "Type a Rpc name and press ENTER to search."
-        "\nUP/DOWN Select\tENTER Choose\tTAB Move between windows"
-        "\nF1 View Rpc definition";
-    showMultilineMessage(help_window, help_text);
-    drawCDKSwindow(help_window, 0);
   }
 
   /**
-   * Helper function for creating the search term entry.
+   * Start watching. Returns false if watching is not supported.
    */
-  void createSearchEntryOrDie() {
-    /* Create the entry field widget. */
-    search_term_entry = newCDKEntry (cdk_screen,
-        LEFT, TOP,
-        /*title=*/"", /*label=*/"", A_NORMAL, ' ', vMIXED,
-        num_cols, 0, 256,
-        TRUE, FALSE);
-
-    /* Is the widget null? */
-    if (search_term_entry == 0)
-    {
-      /* Clean up. */
-      destroyCDKScreen(cdk_screen);
-      endCDK ();
-
-      printf ("Cannot create the entry box. Is the window too small?\n");
-      exit(1);
+  bool start() {
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+      return false;
     }
-    drawCDKEntry(search_term_entry, 1);
-    cur_object = (CDKOBJS*) search_term_entry;
+    thread = std::thread([this] { run(); });
+    return true;
+#else
+    return false;
+#endif
   }
 
+private:
+  typedef ProtoPathWalker::WalkedDirectory WalkedDirectory;
+
+  const Options& options;
+  ProtoLoader* loader;
+  ProtoUpdates* updates;
+  int inotify_fd;
+  std::thread thread;
+  std::atomic<bool> stopping;
+
   /**
-   * Helper function for creating the selection box. Note that this assumes
-   * that items already exists and is populated with the contents of
-   * found_descriptors.
+   * The directories behind each watch descriptor. Proto paths may overlap, so
+   * a directory can be watched under several proto paths at once.
    */
-  void createAndFocusSelection() {
-    static const char *choices[] = { "", "" };
-    selection = newCDKSelection (cdk_screen,
-        LEFT,
-        3,
-        CDKparsePosition("RIGHT"),
-        std::min(num_rows * 2 / 3, num_rows - ROWS_FOR_ONSCREEN_HELP - 1),
-        num_cols,
-        /*title=*/"",
-        (CDK_CSTRING2) items,
-        found_descriptors.size(),
-        (CDK_CSTRING2) choices, 2,
-        A_REVERSE,
-        TRUE,
-        FALSE);
+  std::unordered_map<int, std::vector<WalkedDirectory>> watches;
+
+#ifdef __linux__
+  void run() {
+    ProtoPathWalker walker(options.protoPaths, options.excludes, options.jobs);
+    walker.walk();
+    addWatches(walker.takeDirectories());
+
+    std::set<std::string> changed;
+    bool reload_all = false;
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    while (!stopping) {
+      struct pollfd poll_fd = {inotify_fd, POLLIN, 0};
+      bool pending = reload_all || !changed.empty();
+      int ready = poll(&poll_fd, 1, pending ? 200 : 1000);
+      if (ready < 0 && errno != EINTR) {
+        break;
+      }
+      if (ready <= 0) {
+        if (pending) {
+          if (reload_all) {
+            for (const std::string& filename : loader->getFilenames()) {
+              changed.insert(filename);
+            }
+          }
+          std::string errors;
+          std::shared_ptr<ProtoGeneration> generation = loader->reload(changed, &errors);
+          if (generation) {
+            updates->publish(generation, "");
+            generation->indexTypes();
+          } else if (!errors.empty()) {
+            updates->publish(NULL, "Failed to reload protos.\n" + errors);
+          }
+          changed.clear();
+          reload_all = false;
+        }
+        continue;
+      }
 
-    /* Is the selection list null? */
-    if (selection == 0)
-    {
-      /* Exit CDK. */
-      destroyCDKScreen (cdk_screen);
-      endCDK ();
+      ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+      for (char* p = buffer; p < buffer + length;) {
+        const struct inotify_event* event = (const struct inotify_event*) p;
+        p += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          // Events were lost, so anything may have changed.
+          reload_all = true;
+        } else {
+          handleEvent(event, &changed);
+        }
+      }
+    }
+    close(inotify_fd);
+  }
 
-      printf ("Cannot to create the selection list.\n");
-      printf ("Is the window too small?\n");
-      exit(1);
+  void handleEvent(const struct inotify_event* event, std::set<std::string>* changed) {
+    auto it = watches.find(event->wd);
+    if (it == watches.end()) {
+      return;
+    }
+    if (event->mask & IN_IGNORED) {
+      watches.erase(it);
+      return;
+    }
+    if (event->len == 0) {
+      return;
+    }
+    std::string name = event->name;
+    bool is_directory = event->mask & IN_ISDIR;
+    bool is_proto = name.size() > 6 && name.compare(name.size() - 6, 6, ".proto") == 0;
+    // Copy, since adding and removing watches below may modify watches.
+    std::vector<WalkedDirectory> directories = it->second;
+    for (const WalkedDirectory& directory : directories) {
+      std::string path = directory.path.empty() ? name : directory.path + "/" + name;
+      if (directory.rules->ignores(path, name, is_directory)) {
+        continue;
+      }
+      if (!is_directory) {
+        if (is_proto) {
+          changed->insert(path);
+        }
+      } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        ProtoPathWalker walker(options.protoPaths, options.excludes, 1);
+        for (const std::string& filename : walker.walk(directory.root, path)) {
+          changed->insert(filename);
+        }
+        addWatches(walker.takeDirectories());
+      } else if (event->mask & IN_MOVED_FROM) {
+        // Unlike a deleted directory, a moved directory does not report its
+        // contents, so everything loaded from below it has changed.
+        std::string prefix = path + "/";
+        for (const std::string& filename : loader->getFilenames()) {
+          if (filename.compare(0, prefix.size(), prefix) == 0) {
+            changed->insert(filename);
+          }
+        }
+        removeWatches(directory.root, prefix);
+      }
     }
-    cur_object = setCDKFocusCurrent(cdk_screen, (CDKOBJS*) selection);
-    unsetFocus(cur_object);
-    setFocus(cur_object);
   }
-};
 
-/**
- * Make sure there's enough of a window to render a meaningful UI, and exit if
- * that is not the case.
- */
-void ensureMinWindowSize() {
-  if (num_rows < ROWS_FOR_ONSCREEN_HELP + 5) {
-    endCDK ();
-    printf("\n\nWindow is too small to render RpcExplorer.\n");
-    exit(0);
+  void addWatches(std::vector<WalkedDirectory> directories) {
+    bool out_of_watches = false;
+    for (WalkedDirectory& directory : directories) {
+      std::string disk_path = options.protoPaths[directory.root];
+      if (!directory.path.empty()) {
+        disk_path += "/" + directory.path;
+      }
+      int wd = inotify_add_watch(inotify_fd, disk_path.c_str(),
+          IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+      if (wd < 0) {
+        out_of_watches = out_of_watches || errno == ENOSPC;
+        continue;
+      }
+      std::vector<WalkedDirectory>& watched = watches[wd];
+      bool seen = false;
+      for (const WalkedDirectory& other : watched) {
+        seen = seen || (other.root == directory.root && other.path == directory.path);
+      }
+      if (!seen) {
+        watched.push_back(std::move(directory));
+      }
+    }
+    if (out_of_watches) {
+      updates->publish(NULL, "Not every proto directory can be watched for changes. "
+          "Consider raising fs.inotify.max_user_watches.\n");
+    }
   }
-}
+
+  /**
+   * Stop watching the directories at or below prefix, which ends in a slash,
+   * in the proto path with index root.
+   */
+  void removeWatches(int root, const std::string& prefix) {
+    for (auto it = watches.begin(); it != watches.end();) {
+      std::vector<WalkedDirectory>& watched = it->second;
+      for (auto entry = watched.begin(); entry != watched.end();) {
+        if (entry->root == root && (entry->path + "/").compare(0, prefix.size(), prefix) == 0) {
+          entry = watched.erase(entry);
+        } else {
+          entry++;
+        }
+      }
+      if (watched.empty()) {
+        inotify_rm_watch(inotify_fd, it->first);
+        it = watches.erase(it);
+      } else {
+        it++;
+      }
+    }
+  }
+#endif
+};
 
 /**
- * Run the interactive user interface to search for protos based on curses.
+ * Run the interactive user interface to search for protos based on curses,
+ * until the user quits or interrupts it. Returns the exit status.
  */
-void runCursesInterface(Options& options,
-    const std::map<std::string, const MethodDescriptor*>& method_descriptors) {
+int runCursesInterface(Options& options, ProtoUpdates* updates) {
   /* Reduce the escape delay so that Esc is more snappy.  */
   setenv("ESCDELAY","1", 1);
   initscr();
@@ -1870,45 +6995,100 @@ void runCursesInterface(Options& options,
   }
 
   getmaxyx(stdscr, num_rows, num_cols);
-  ensureMinWindowSize();
-
+  if (!ensureMinWindowSize()) {
+    return 0;
+  }
 
   // A stack containing the current screens to display to the user. The top
   // screen is the one that is actually rendered and receives input. A screen
   // is responsible for rendering itself on construction, and should only be
   // constructed once there is enough information for rendering.
   std::vector<UserFacingPage*> page_stack;
-  RpcSearchPage* search_page = new RpcSearchPage(page_stack, method_descriptors, options);
+  std::shared_ptr<ProtoGeneration> generation(new ProtoGeneration(FileMap(), options));
+  RpcSearchPage* search_page = new RpcSearchPage(page_stack, generation, options);
   page_stack.push_back(search_page);
 
+  // Protos that are loaded in the background are handed to the search page
+  // only while it is on top, so that it does not draw over other pages.
+  bool search_page_outdated = false;
+  std::string notice;
+  std::string status;
+
   // Main user input loop.
   int key_code;
   int function_key;
 
-  while ((key_code = getchCDKObject(
-          (CDKOBJS*)page_stack.back()->getCDKActiveObject(), &function_key))) {
+  // A modal dialog that is interrupted returns before the signal reaches the
+  // wait below, so check before waiting as well.
+  while (!interrupted) {
+    ProtoUpdate update;
+    if (updates->take(&update)) {
+      if (update.fatal) {
+        endCDK ();
+        std::cerr << update.errors;
+        return 1;
+      }
+      if (update.generation) {
+        generation = update.generation;
+        search_page_outdated = true;
+      }
+      if (!update.errors.empty()) {
+        notice = update.errors;
+      }
+      status = update.status;
+    }
+    if (page_stack.back() == search_page) {
+      if (search_page_outdated) {
+        search_page->setGeneration(generation);
+        search_page_outdated = false;
+      }
+      search_page->setStatus(status);
+      if (!notice.empty()) {
+        search_page->showNotice(notice);
+        notice.clear();
+      }
+    }
+
+    CDKOBJS* active_object = (CDKOBJS*)page_stack.back()->getCDKActiveObject();
+    // Stop waiting for input periodically while protos are being loaded, and
+    // when the page has work to do once input stops.
+    int timeout = page_stack.back()->getIdleTimeout();
+    if (!updates->idle() && (timeout < 0 || timeout > 100)) {
+      timeout = 100;
+    }
+    wtimeout(InputWindowOf(active_object), timeout);
+    key_code = getchCDKObject(active_object, &function_key);
+    if (key_code == 0 || interrupted) {
+      break;
+    }
     switch (key_code) {
+      case ERR:
+        // Timed out, which gives loaded protos a chance to be picked up.
+        page_stack.back()->onIdle();
+        break;
       // Global hotkeys should be added here.
       case KEY_F8:
         for (UserFacingPage* page : page_stack) {
           delete page;
         }
-        {
-          page_stack.clear();
-          RpcSearchPage* search_page = new RpcSearchPage(page_stack, method_descriptors, options);
-          page_stack.push_back(search_page);
-        }
+        page_stack.clear();
+        search_page = new RpcSearchPage(page_stack, generation, options);
+        search_page_outdated = false;
+        page_stack.push_back(search_page);
         break;
       case KEY_RESIZE:
         getmaxyx(stdscr, num_rows, num_cols);
-        ensureMinWindowSize();
+        if (!ensureMinWindowSize()) {
+          return 0;
+        }
         if (!page_stack.empty()) {
           page_stack.back()->redraw();
         }
         break;
 
       default:
-        debugMsg("Handling input (key_code = %d, function_key = %d)", key_code, function_key);
+        debugMsg(DEBUG_INPUT, DEBUG_TRACE, "Handling input (key_code = %d, function_key = %d)",
+            key_code, function_key);
         if (page_stack.back()->handleInput(key_code, function_key)) {
           delete page_stack.back();
           page_stack.pop_back();
@@ -1919,9 +7099,9 @@ void runCursesInterface(Options& options,
     }
   }
 
-  /* Clean up and exit. */
+  /* Clean up and let main() exit. */
   endCDK ();
-  exit(0);
+  return 0;
 }
 
 /**
@@ -1931,114 +7111,170 @@ void runCursesInterface(Options& options,
 int main(int argc, char** argv){
   Options options = parseArguments(argc, argv);
 
+  // Keep SIGINT away from the threads started below, which inherit the
+  // blocked signals, so that it interrupts the wait for input in the
+  // interface. It is unblocked again once they are running.
+  sigset_t interrupt_signals;
+  sigemptyset(&interrupt_signals);
+  sigaddset(&interrupt_signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &interrupt_signals, NULL);
+
+  // Write what is left of the debug log when the program exits, including
+  // through exit() when the interface cannot be created.
+  debug_log.start();
+  atexit([] { debug_log.stop(); });
+
   auto start_time = std::chrono::high_resolution_clock::now();
-  std::vector<std::string> allFilenames;
-  if (options.protoFiles.empty()) {
+  if (options.protoFiles.empty() && options.descriptor_sets.empty()) {
     offer_advice = getenv("RPC_EXPLORER_NO_ADVICE") == NULL;
     if (offer_advice) {
       proto_paths_for_advice = options.protoPaths;
     }
-    // If the user did not specify proto files, then parse all file names from
-    // the filesystem, since SourceTreeDescriptorDatabase does not appear to
-    // implement FindAllFileNames.
-    for (const char* importPath: options.protoPaths) {
-      std::filesystem::path protoDirPath(importPath);
-      std::filesystem::recursive_directory_iterator it(protoDirPath,
-          std::filesystem::directory_options::follow_directory_symlink);
-      for (const std::filesystem::directory_entry& dir_entry : it) {
-        if (dir_entry.is_regular_file()) {
-          auto path = dir_entry.path();
-          if (path.extension().string() == ".proto") {
-            // We need to strip out the first directory because the
-            // recursive_directory_iterator includes the name of the import path
-            // and the proto tools assume paths relative to the import path.
-            allFilenames.push_back(path.lexically_relative(protoDirPath));
-          }
-        }
-      }
-    }
-  } else {
-    // The user specified proto files so just use those. Note that we assume
-    // the user has given filenames relative to at least one of the import
-    // paths, just like protoc.
-    for (const char* filename : options.protoFiles) {
-      allFilenames.push_back(filename);
-    }
   }
 
-  if (options.verbose) {
-    std::cerr << "Filenames that will be imported." << std::endl;
-    for (std::string& filename: allFilenames) {
-      std::cerr << '\t' << filename << std::endl;
-    }
+  // Store the time spent loading protos in milliseconds so we can use it for
+  // giving advice later. Zero until loading finishes.
+  std::atomic<int64_t> time_spent_loading_protos_ms(0);
+
+  // Set when the program is about to exit, so that loading stops early.
+  std::atomic<bool> stop_loading(false);
+
+  // Load the protos on a background thread while the curses interface is
+  // already running, so that methods can be searched for as soon as their
+  // files have been parsed. When printing to stderr, loading finishes before
+  // the interface starts, so that the output stays readable.
+  ProtoUpdates updates;
+  ProtoLoader loader(options, &updates);
+  ProtoWatcher watcher(options, &loader, &updates);
+  StartupProfile profile;
+  if (!options.profile_startup.empty()) {
+    loader.setProfile(&profile);
   }
-
-  // Construct source tree and importer.
-  DiskSourceTree diskSourceTree;
-  for (const char* importPath: options.protoPaths) {
-    diskSourceTree.MapPath("", importPath);
+  loader.setStopFlag(&stop_loading);
+
+  // Load the files that methods were used from most in earlier runs before
+  // searching the proto paths for the rest.
+  std::vector<std::string> frequent_filenames;
+  std::unique_ptr<UsageProfile> usage;
+  if (!options.state_dir.empty()) {
+    usage.reset(new UsageProfile(options.state_dir, options.protoPaths));
+    usage_profile = usage.get();
+    if (options.protoFiles.empty() && options.descriptor_sets.empty()) {
+      usage->load();
+      frequent_filenames = usage->getFrequentFiles(50);
+    }
   }
+  std::thread loading_thread([&options, &updates, &loader, &watcher, &profile,
+      &frequent_filenames, &time_spent_loading_protos_ms, &stop_loading, start_time] {
+    std::chrono::duration<double> first_time(0);
+    if (!frequent_filenames.empty()) {
+      updates.setStatus("Loading the most used proto files...");
+      loader.loadFirst(frequent_filenames);
+      first_time = std::chrono::high_resolution_clock::now() - start_time;
+      profile.recordPhase("frequent", first_time.count());
+    }
 
-  class ErrorReporter: public MultiFileErrorCollector {
-    public:
-      virtual void AddError(const std::string & filename, int line, int column, const std::string & message) {
-        std::cerr << "Error occured for " << filename << ":" << line << ":" <<
-            column  << " " << message << std::endl;
+    std::vector<std::string> allFilenames;
+    if (options.protoFiles.empty() && options.descriptor_sets.empty()) {
+      // If the user did not specify proto files, then parse all file names from
+      // the filesystem, since SourceTreeDescriptorDatabase does not appear to
+      // implement FindAllFileNames.
+      updates.setStatus("Searching for proto files...");
+      ProtoPathWalker walker(options.protoPaths, options.excludes, options.jobs);
+      walker.setStopFlag(&stop_loading);
+      allFilenames = walker.walk();
+      std::chrono::duration<double> walk_time =
+          std::chrono::high_resolution_clock::now() - start_time - first_time;
+      profile.recordPhase("walk", walk_time.count());
+    } else {
+      // The user specified proto files so just use those, or none to use
+      // every file in the descriptor sets. Note that we assume the user has
+      // given filenames relative to at least one of the import paths, just
+      // like protoc.
+      for (const char* filename : options.protoFiles) {
+        allFilenames.push_back(filename);
       }
-  } errorReporter;
+    }
 
-  // Build all the file protos, map the full service and method names to
-  // ServiceDescriptor and MethodDescriptor respectively, because they're all
-  // cross-linked.
-  Importer importer(&diskSourceTree, &errorReporter);
-  std::map<std::string, const ServiceDescriptor*> serviceDescriptors;
-  std::map<std::string, const MethodDescriptor*> methodDescriptors;
-  for (std::string& filename: allFilenames) {
-    const FileDescriptor* fd = importer.Import(filename);
-    if (fd == NULL) {
-      std::cerr << "Encoutered errors causing a full FD on import. Aborting..." << std::endl;
-      exit(1);
+    if (options.verbose) {
+      std::cerr << "Filenames that will be imported." << std::endl;
+      for (std::string& filename: allFilenames) {
+        std::cerr << '\t' << filename << std::endl;
+      }
     }
 
-    for (int i = 0; i < fd->service_count(); i++) {
-      const ServiceDescriptor* service = fd->service(i);
-      serviceDescriptors[tolower(service->full_name())] = service;
-      for (int j = 0; j < service->method_count(); j++) {
-        const MethodDescriptor* method = service->method(j);
-        methodDescriptors[tolower(method->full_name())] = method;
+    if (!loader.load(allFilenames)) {
+      return;
+    }
+    std::chrono::duration<double> total_time =
+        std::chrono::high_resolution_clock::now() - start_time;
+    time_spent_loading_protos_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(total_time).count();
+    if (!options.profile_startup.empty()) {
+      profile.recordPhase("total", total_time.count());
+      std::string error;
+      if (!profile.write(options.profile_startup, loader.getFiles(), &error)) {
+        updates.publish(NULL, error);
       }
     }
+
+    bool watching = options.watch && !stop_loading && watcher.start();
+    if (options.watch && !watching) {
+      updates.publish(NULL, "Unable to watch the proto paths for changes.\n");
+    }
+    if (!watching) {
+      updates.finish();
+    }
+  });
+  pthread_sigmask(SIG_UNBLOCK, &interrupt_signals, NULL);
+  if (options.verbose || options.profile_startup == "-") {
+    loading_thread.join();
   }
 
-  auto end_time = std::chrono::high_resolution_clock::now();
-  // Store the time spent loading protos so we can use it for giving advice
-  // later.
-  static std::chrono::duration<double> time_spent_loading_protos = end_time - start_time;
+  // Make Control-C end the interface, so that we exit with code 0 and print
+  // advice. Without SA_RESTART, the signal also interrupts the wait for input.
+  struct sigaction interrupt_action = {};
+  sigemptyset(&interrupt_action.sa_mask);
+  interrupt_action.sa_handler = [](int sig_num) {
+    interrupted = 1;
+  };
+  sigaction(SIGINT, &interrupt_action, NULL);
+  // Switch between logging all debug messages and the configured ones.
+  signal(SIGUSR1, [](int sig_num) {
+    debug_log.toggleAll();
+  });
 
-  // Install signal handler so that we exit with code 0 on Control-C and print advice.
-  signal(SIGINT, [](int sig_num) {
-    endCDK();
-    if (offer_advice && !proto_files_of_used_methods.empty()) {
-      std::cerr
-        << "RpcExplorer spent "
-        << time_spent_loading_protos.count() << " seconds "
-        << "loading all of the proto files in the following directories:\n"
-        << std::endl;
-      for (const char* proto_path : proto_paths_for_advice) {
-        std::cerr << "\t" << proto_path << std::endl;
-      }
-      std::cerr
-        << "\nYou used protos only from the following files:\n"
-        << std::endl;
-      for (std::string proto_file : proto_files_of_used_methods) {
-        std::cerr << "\t" << proto_file << std::endl;
-      }
-      std::cerr << "\nTo make RpcExplorer load only these proto files,\n"
-        "append them as trailing arguments to your next invocation.\n\n"
-        << "To stop seeing this message, set RPC_EXPLORER_NO_ADVICE."
-        << std::endl;
+  int status = runCursesInterface(options, &updates);
+
+  // Stop loading instead of waiting for it, since nothing will be shown.
+  stop_loading = true;
+  if (loading_thread.joinable()) {
+    loading_thread.join();
+  }
+  if (usage) {
+    usage->save();
+  }
+
+  if (interrupted && offer_advice && !proto_files_of_used_methods.empty() &&
+      time_spent_loading_protos_ms > 0) {
+    std::cerr
+      << "RpcExplorer spent "
+      << time_spent_loading_protos_ms / 1000.0 << " seconds "
+      << "loading all of the proto files in the following directories:\n"
+      << std::endl;
+    for (const char* proto_path : proto_paths_for_advice) {
+      std::cerr << "\t" << proto_path << std::endl;
     }
-    exit(0);
-  });
-  runCursesInterface(options, methodDescriptors);
+    std::cerr
+      << "\nYou used protos only from the following files:\n"
+      << std::endl;
+    for (std::string proto_file : proto_files_of_used_methods) {
+      std::cerr << "\t" << proto_file << std::endl;
+    }
+    std::cerr << "\nTo make RpcExplorer load only these proto files,\n"
+      "append them as trailing arguments to your next invocation.\n\n"
+      << "To stop seeing this message, set RPC_EXPLORER_NO_ADVICE."
+      << std::endl;
+  }
+  return status;
 }